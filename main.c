@@ -2,22 +2,75 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <limits.h>
 
 #define MAX_FRAMES 65536
 #define MAX_POINTS 100000
 
+// Pixel data in raw atlases starts on a page boundary so it can be mmap'd and uploaded directly
+#define RAW_ALIGNMENT 4096
+#define RAW_HEADER_SIZE 64
+#define RAW_VERSION 2
+
+// Frames are aligned to this with --mips, which keeps the first log2(MIP_ALIGN) + 1 levels from
+// mixing texels of neighbouring frames
+#define MIP_ALIGN 16
+#define MIP_LEVELS_ISOLATED 5
+
+// --scales accepts up to MAX_SCALES tiers, each shrinking by at most 1 / MIN_SCALE
+#define MAX_SCALES 8
+#define MIN_SCALE 0.0625f
+#define MAX_RESAMPLE_TAPS 18
+
+// Packing flags. Partial packs as many rectangles as possible instead of giving up on the first one
+// that doesn't fit, rotate lets the packers turn rectangles sideways. Keep (MaxRects only) leaves the
+// rectangles that come in with was_packed set where they are if that spot is still free.
+#define PACK_PARTIAL 1
+#define PACK_ROTATE 2
+#define PACK_KEEP 4
+
+// was_packed of a rectangle the packer turned sideways, its w and h are then swapped
+#define PACKED_ROTATED 2
+
+// Side of the tiles frames turned sideways are copied in
+#define TRANSPOSE_TILE 16
+
+// Side of the blocks --dirty-rects compares the old and new atlas in
+#define DIRTY_BLOCK 32
+
+// --pack auto searches sizes up to this unless a maximum is given, and tries this many widths at once
+#define PACK_AUTO_MAX_SIZE 16384
+#define PACK_AUTO_WIDTHS 8
+
+#define DEFLATE_WINDOW_SIZE 32768
+#define DEFLATE_WINDOW_MASK (DEFLATE_WINDOW_SIZE - 1)
+#define DEFLATE_HASH_BITS 15
+#define DEFLATE_HASH_SIZE (1 << DEFLATE_HASH_BITS)
+#define DEFLATE_MIN_MATCH 3
+#define DEFLATE_MAX_MATCH 258
+
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 
-#define STB_IMAGE_WRITE_IMPLEMENTATION
-#include "stb_image_write.h"
-
 #define STB_RECT_PACK_IMPLEMENTATION
 #include "stb_rect_pack.h"
 
 #define TINYFILES_IMPLEMENTATION
 #include "tinyfiles.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
 typedef struct
 {
     unsigned char r, g, b, a;
@@ -31,14 +84,87 @@ typedef struct
 
     int x, y;
     int w, h;
+
+    // Index of the frame whose pixels (and atlas rectangle) this one shares, its own index if none
+    int alias;
+
+    // How the shared pixels are turned into this frame, see TRANSFORM_*
+    int transform;
 } Rect;
 
+// Frame pixel (x, y) is found in its atlas rectangle by first mirroring x and/or y within the
+// frame and then swapping x and y. Rotations are a swap plus a mirror.
+#define TRANSFORM_MIRROR_X 1
+#define TRANSFORM_MIRROR_Y 2
+#define TRANSFORM_TRANSPOSE 4
+
 typedef struct
 {
     int x, y;
     int distFromEdge;
 } Point;
 
+typedef enum
+{
+    OUTPUT_PNG,
+    OUTPUT_QOI,
+    OUTPUT_RAW,
+    OUTPUT_BC1,
+    OUTPUT_BC3
+} OutputFormat;
+
+// Pixel formats of the raw output, the values are stored in its header
+typedef enum
+{
+    RAW_PIXEL_RGBA8,
+    RAW_PIXEL_RGBA4444,
+    RAW_PIXEL_RGB565,
+    RAW_PIXEL_RGBA5551
+} RawPixelFormat;
+
+typedef enum
+{
+    ETC2_NONE,
+    ETC2_FAST,
+    ETC2_QUALITY
+} Etc2Mode;
+
+// How --pack places the frames
+typedef enum
+{
+    PACKER_SKYLINE,
+    PACKER_SKYLINE_BF,
+    PACKER_MAXRECTS,
+    PACKER_MAXRECTS_CONTACT,
+    PACKER_SHELF,
+    PACKER_BEST
+} Packer;
+
+// Knobs behind the --encode presets
+typedef struct
+{
+    const char* name;
+
+    // PNG filter used for every row, or -1 to pick the best one per row
+    int filter;
+
+    // How many earlier occurrences the match finder looks at
+    int maxChain;
+    bool lazy;
+
+    // Positions inside matches longer than this aren't added to the hash chains
+    int maxInsertLen;
+} EncodeSettings;
+
+static const EncodeSettings EncodePresets[] = {
+    { "fast", 1, 2, false, 4 },
+    { "balanced", -1, 32, false, DEFLATE_MAX_MATCH },
+    { "max", -1, 1024, true, DEFLATE_MAX_MATCH }
+};
+
+#define NUM_ENCODE_PRESETS (int)(sizeof(EncodePresets) / sizeof(EncodePresets[0]))
+#define DEFAULT_ENCODE_PRESET 1
+
 typedef struct
 {
     bool isDir;
@@ -50,10 +176,213 @@ typedef struct
     bool pot;
     int dw;
     int packW, packH;
+
+    // Grid rows as tall as their tallest frame and frames only as wide as they are, instead of cells
+    bool rowGrid;
+
+    // With --pack auto, packW and packH are the largest size the search may pick
+    bool packAuto;
+    bool pages;
+    bool rotate;
+    Packer packer;
+
+    // Metadata of an earlier run whose frame positions --seed keeps
+    const char* seed;
 	bool label;
     bool metadata;
+    bool dedup;
+    bool dedupTransforms;
+    OutputFormat format;
+    int encodePreset;
+    bool benchmark;
+    bool rgba;
+
+    // Write the regions that differ from the atlas already on disk before overwriting it
+    bool dirtyRects;
+
+    // Number of synthetic frames --bench-pack times the packers on, nothing else is done then
+    int benchPack;
+
+    // Also write an ETC2 KTX next to the output image
+    Etc2Mode etc2;
+    bool mips;
+    RawPixelFormat pixelFormat;
+
+    // An atlas is written for every scale, the ones other than 1 get an @0.5x style suffix
+    float scales[MAX_SCALES];
+    int numScales;
+
+    // Packed frames are placed at multiples of this
+    int packAlign;
 } Args;
 
+// Work is split into independent jobs which are handed out to a small pool of threads
+#define MAX_THREADS 64
+
+static int NumThreads = 1;
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL __thread
+#endif
+
+// Set while a thread runs ParallelFor jobs, so nested calls run inline instead of spawning more threads
+static THREAD_LOCAL bool InParallelFor = false;
+
+typedef void (*ParallelFunc)(void* data, int index, int thread);
+
+typedef struct
+{
+    ParallelFunc func;
+    void* data;
+    int count;
+    volatile long next;
+} ParallelJob;
+
+typedef struct
+{
+    ParallelJob* job;
+    int thread;
+} ParallelWorker;
+
+static long AtomicFetchAdd(volatile long* value)
+{
+#ifdef _WIN32
+    return InterlockedIncrement(value) - 1;
+#else
+    return __sync_fetch_and_add(value, 1);
+#endif
+}
+
+static void RunParallelWorker(ParallelWorker* worker)
+{
+    ParallelJob* job = worker->job;
+
+    bool nested = InParallelFor;
+    InParallelFor = true;
+
+    for(;;) {
+        long i = AtomicFetchAdd(&job->next);
+
+        if(i >= job->count) {
+            break;
+        }
+
+        job->func(job->data, (int)i, worker->thread);
+    }
+
+    InParallelFor = nested;
+}
+
+#ifdef _WIN32
+static DWORD WINAPI ParallelThreadProc(LPVOID param)
+{
+    RunParallelWorker(param);
+    return 0;
+}
+#else
+static void* ParallelThreadProc(void* param)
+{
+    RunParallelWorker(param);
+    return NULL;
+}
+#endif
+
+// Wall clock time, since CPU time adds up across threads
+static double GetSeconds(void)
+{
+#ifdef _WIN32
+    LARGE_INTEGER freq, now;
+
+    QueryPerformanceFrequency(&freq);
+    QueryPerformanceCounter(&now);
+
+    return (double)now.QuadPart / (double)freq.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+#endif
+}
+
+static int GetCpuCount(void)
+{
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+
+    return (int)info.dwNumberOfProcessors;
+#else
+    long count = sysconf(_SC_NPROCESSORS_ONLN);
+    return count > 0 ? (int)count : 1;
+#endif
+}
+
+// Calls func for every index in [0, count) and returns once all of them are done.
+// The thread argument is in [0, NumThreads) and can be used to index per-thread scratch memory.
+// Calls made from inside a job run all of their indices on the calling thread.
+static void ParallelFor(int count, ParallelFunc func, void* data)
+{
+    ParallelJob job = { func, data, count, 0 };
+
+    int numThreads = NumThreads < count ? NumThreads : count;
+
+    if(InParallelFor && numThreads > 1) {
+        numThreads = 1;
+    }
+
+    // A lone job runs like a plain call, so calls nested inside it can still use every thread
+    if(numThreads == 1) {
+        for(int i = 0; i < count; ++i) {
+            func(data, i, 0);
+        }
+
+        return;
+    }
+
+    ParallelWorker workers[MAX_THREADS];
+
+#ifdef _WIN32
+    HANDLE threads[MAX_THREADS];
+#else
+    pthread_t threads[MAX_THREADS];
+#endif
+
+    bool started[MAX_THREADS] = { false };
+
+    for(int t = 0; t < numThreads; ++t) {
+        workers[t].job = &job;
+        workers[t].thread = t;
+    }
+
+    // If a thread fails to start, the others simply pick up its share of the jobs
+    for(int t = 1; t < numThreads; ++t) {
+#ifdef _WIN32
+        threads[t] = CreateThread(NULL, 0, ParallelThreadProc, &workers[t], 0, NULL);
+        started[t] = threads[t] != NULL;
+#else
+        started[t] = pthread_create(&threads[t], NULL, ParallelThreadProc, &workers[t]) == 0;
+#endif
+    }
+
+    if(numThreads > 0) {
+        RunParallelWorker(&workers[0]);
+    }
+
+    for(int t = 1; t < numThreads; ++t) {
+        if(!started[t]) continue;
+
+#ifdef _WIN32
+        WaitForSingleObject(threads[t], INFINITE);
+        CloseHandle(threads[t]);
+#else
+        pthread_join(threads[t], NULL);
+#endif
+    }
+}
+
 static Pixel NumFont[10][3 * 5];
 
 static void GenerateNumFont(Pixel col)
@@ -145,7 +474,7 @@ static void GenerateNumFont(Pixel col)
 	}
 }
 
-static int CompareFramesRowThresh;
+static int FrameRowThresh;
 
 static void PrintUsage(const char* app)
 {
@@ -156,12 +485,31 @@ static void PrintUsage(const char* app)
     fprintf(stderr, "\t--frame-height DESIRED_FRAME_HEIGHT\n\t\tDesired height of the frames.\n");
     fprintf(stderr, "\t-e EDGE_DISTANCE_THRESHOLD\n\t\tThe edge distance threshold is used to determine whether disconnected pixels still belongs to a frame.\n\t\tIf the distance from these pixels to the nearest edge is less than or equal to the\n\t\tthreshold, then they're incorporated.\n");
     fprintf(stderr, "\t--min-width MIN_FRAME_WIDTH\n\t--min-height MIN_FRAME_HEIGHT\n\t\tAll frames smaller than these in both dimensions will be discarded.\n\t\tBy default these are frame width / 4 and frame height / 4.\n");
-    fprintf(stderr, "\t--pot\n\t\tThis is optional. It makes the app generate a power of two image.\n");
-    fprintf(stderr, "\t--dest-width DESIRED_OUTPUT_IMAGE_WIDTH\n\t\tThis is optional and mutually exclusive with the --pot option.\n\t\tThis is the width you want the output image to be.\n\t\tThe height will be determined from the number of frames detected.\n");
+    fprintf(stderr, "\t--pot\n\t\tThis is optional. It makes the app generate the smallest power of two image the frames fit in,\n\t\twhich needn't be square. With --pack auto, only power of two sizes are tried.\n");
+    fprintf(stderr, "\t--dest-width DESIRED_OUTPUT_IMAGE_WIDTH\n\t\tThis is optional and mutually exclusive with the --pot option.\n\t\tThis is the width you want the output image to be.\n\t\tThe height will be just enough rows for the number of frames detected.\n");
 	fprintf(stderr, "\t--row-thresh DESIRED_ROW_THRESHOLD\n\t\tThis is equal to half the frame height by default.\n\t\tIt is used to order the resulting frames. If two frames are within the threshold on the y axis\n\t\tthen they are ordered from left-to-right next to each other in the final image.\n");
 	fprintf(stderr, "\t--label\n\t\tPrints the rectangle indices into the top-left corner of the frames.\n");
 	fprintf(stderr, "\t--metadata\n\t\tIf specified, the rectangles are output to a text file in the format mentioned below.\n");
+    fprintf(stderr, "\t--row-grid\n\t\tInstead of giving every frame a frame width x frame height cell, lays the frames out in the same\n\t\torder left to right, each only as wide as it is, in rows as tall as their tallest frame. Frames\n\t\taren't centered then and the metadata holds their own size. With --pot, the smallest power of\n\t\ttwo image is picked.\n");
     fprintf(stderr, "\t--pack PACKED_IMAGE_WIDTH PACKED_IMAGE_HEIGHT\n\t\tIf this is supplied, then the frames are tightly packed and metadata is generated for each frame.\n\t\tThe metadata is simply a text file with the number of frames followed by 4 integers\n\t\tfor each frame: x y w h\n");
+    fprintf(stderr, "\t--pack auto [MAX_WIDTH MAX_HEIGHT]\n\t\tPacks the frames into the smallest image they fit in (by area), %d x %d at most unless a maximum\n\t\tis given. Sizes are searched in parallel with the frames detected once.\n", PACK_AUTO_MAX_SIZE, PACK_AUTO_MAX_SIZE);
+    fprintf(stderr, "\t--pages\n\t\tFrames that don't fit into the --pack size (or the --pack auto maximum) go on further pages. The\n\t\tpages are named like atlas_0.png, atlas_1.png... and the metadata gets a last column with the page\n\t\tof every frame. With --format raw, every page holds the frame table of all frames,\n\t\tand its entries tell which page each frame is on.\n");
+    fprintf(stderr, "\t--rotate\n\t\tLets the packer turn frames sideways when that packs them tighter. Such frames are stored\n\t\ttransposed and their rectangle's width and height are swapped. The metadata gets the transform\n\t\tcolumn described under --dedup-transforms, where they have bit 2 flipped.\n");
+    fprintf(stderr, "\t--seed PREVIOUS_METADATA\n\t\tKeeps every frame that is as big as it was in the metadata of an earlier run (written with\n\t\t--metadata) where it was, so only new and resized frames move. Those are put into the space left\n\t\tover with maxrects. If they don't fit or there's no such metadata yet, everything is packed\n\t\tfrom scratch with --packer instead. Frames are matched by index. With --scales, the other tiers\n\t\tread the metadata named like theirs.\n");
+    fprintf(stderr, "\t--dirty-rects\n\t\tBefore overwriting the output image, compares it with the new atlas in %dx%d blocks and writes\n\t\tthe rectangles that changed to atlas_dirty.txt, in the metadata's format: the number of rectangles\n\t\tfollowed by x y w h for each. They're what has to be uploaded again (with glTexSubImage2D, for\n\t\texample), which goes well with --seed. If there's no old image or it has another size, the whole\n\t\tatlas is listed. Only the top mip level is compared.\n", DIRTY_BLOCK, DIRTY_BLOCK);
+    fprintf(stderr, "\t--packer (skyline|skyline-bf|maxrects|maxrects-contact|shelf|best)\n\t\tHow --pack places the frames. skyline (the default) is the fastest, skyline-bf picks the best\n\t\tfitting spot on the skyline instead of the lowest. maxrects tracks every free rectangle and puts\n\t\teach frame where it leaves the shortest side over, which usually wastes much less space on mixed\n\t\tframe sizes. maxrects-contact instead picks the spot touching the most edges. shelf simply\n\t\tlines the frames up in rows, which is a few percent less dense but packs 100k+ frames in\n\t\tmilliseconds. best runs all but shelf\n\t\twith the frames sorted by height, area, perimeter and longest side in parallel, prints how much of\n\t\tthe covered area each one fills and keeps the most occupied result.\n");
+    fprintf(stderr, "\t--format (png|qoi|raw|bc1|bc3)\n\t\tThe format of the output image. This is png by default.\n\t\tQOI is much faster to encode and decode than PNG, which is handy for quick iteration.\n\t\tbc1 and bc3 write block compressed (DXT1/DXT5) DDS files. Packed frames are then placed on\n\t\t4 pixel boundaries so blocks never straddle two frames.\n\t\tRaw writes a binary file meant to be mmap'd by the runtime (all integers little-endian):\n\t\t\t64 byte header: 'SPXA' version width height pixel_format row_pitch num_frames\n\t\t\t                frame_table_offset pixel_data_offset(u64) pixel_data_size(u64)\n\t\t\tframe table: num_frames entries of u32 x y w h transform page, with transform as in the\n\t\t\t             metadata's transform column (see --dedup-transforms and --rotate) and\n\t\t\t             page the --pages page holding the frame (0 without --pages)\n\t\t\tpixel data: uncompressed rows in the --pixel-format starting at a %d byte aligned offset\n", RAW_ALIGNMENT);
+    fprintf(stderr, "\t--pixel-format (rgba8|rgba4444|rgb565|rgba5551)\n\t\tPixel format of the raw output, rgba8 by default. The others are 16-bit little-endian values\n\t\twith the first named channel in the top bits (the GL packed layouts). Colors are ordered dithered.\n\t\tThe header's pixel_format is 0 to 3 in the order listed.\n");
+    fprintf(stderr, "\t--encode (fast|balanced|max)\n\t\tTrades PNG encoding speed for file size. This is balanced by default.\n\t\tfast uses a fixed filter and a shallow match search, which is handy for preview builds.\n");
+    fprintf(stderr, "\t--rgba\n\t\tAlways write 4-component PNGs. By default, atlases with 256 colors or fewer are written as indexed PNGs.\n");
+    fprintf(stderr, "\t--benchmark\n\t\tEncodes the PNG with every --encode preset and prints the size and time of each. Only\n\t\tsupported with --format png.\n");
+    fprintf(stderr, "\t--bench-pack NUM_FRAMES\n\t\tInstead of extracting anything, packs NUM_FRAMES random frames of a few synthetic sets with every\n\t\tpacker and prints the time and occupancy of each. No input or output image is needed then.\n");
+    fprintf(stderr, "\t--etc2 (fast|quality)\n\t\tAlso writes the atlas as an ETC2 RGBA8 compressed KTX file next to the output image.\n\t\tfast is meant for iteration, quality searches more block encodings for release builds.\n");
+    fprintf(stderr, "\t--mips\n\t\tGenerates the full mip chain of the atlas. DDS and KTX files hold every level, other formats\n\t\tget a file per level named like atlas_mip1.png. Frames are placed on %d pixel boundaries so\n\t\tthe first %d levels never blend neighbouring frames.\n", MIP_ALIGN, MIP_LEVELS_ISOLATED);
+    fprintf(stderr, "\t--scales SCALE[,SCALE...]\n\t\tWrites an atlas for every scale from the frames detected once, for example --scales 1,0.5,0.25.\n\t\tFrames are shrunk with an area filter and the output and metadata of a scale other than 1 are\n\t\tnamed like atlas@0.5x.png. Frame, dest and pack sizes are scaled to match. Scales are in [%g, 1].\n", MIN_SCALE);
+    fprintf(stderr, "\t--dedup\n\t\tIdentical frames are stored in the atlas once. The metadata still lists every frame, with a fifth\n\t\tcolumn holding the index of the frame whose rectangle it shares (its own index if it's unique).\n");
+    fprintf(stderr, "\t--dedup-transforms\n\t\tLike --dedup, but mirrored and 90 degree rotated copies count as duplicates too. The metadata gets a\n\t\tsixth column with the transform: to read frame pixel (x, y) from the rectangle, mirror x if bit 0\n\t\tis set, mirror y if bit 1 is set and then swap x and y if bit 2 is set.\n");
+    fprintf(stderr, "\t--threads NUM_THREADS\n\t\tNumber of threads used to encode the output. Defaults to the number of CPUs.\n");
 }
 
 static bool ParseArgs(Args* args, int argc, char** argv)
@@ -174,6 +522,12 @@ static bool ParseArgs(Args* args, int argc, char** argv)
     
 	memset(args, 0, sizeof(Args));
 
+    args->encodePreset = DEFAULT_ENCODE_PRESET;
+    args->scales[0] = 1.0f;
+    args->numScales = 1;
+
+    NumThreads = GetCpuCount();
+
     for(int i = 1; i < argc; ++i) {
         if(strcmp(argv[i], "-h") == 0) {
             PrintUsage(argv[0]);
@@ -201,16 +555,211 @@ static bool ParseArgs(Args* args, int argc, char** argv)
             args->maxDistFromEdge = atoi(argv[i + 1]);
             i += 1;
         } else if(strcmp(argv[i], "--pack") == 0) {
-            args->packW = atoi(argv[i + 1]);
-            args->packH = atoi(argv[i + 2]);
-            i += 2;
+            if(i + 1 < argc && strcmp(argv[i + 1], "auto") == 0) {
+                args->packAuto = true;
+                args->packW = PACK_AUTO_MAX_SIZE;
+                args->packH = PACK_AUTO_MAX_SIZE;
+                i += 1;
+
+                // The maximum size is optional
+                if(i + 2 < argc && argv[i + 1][0] >= '0' && argv[i + 1][0] <= '9' && argv[i + 2][0] >= '0' && argv[i + 2][0] <= '9') {
+                    args->packW = atoi(argv[i + 1]);
+                    args->packH = atoi(argv[i + 2]);
+                    i += 2;
+
+                    if(args->packW <= 0 || args->packH <= 0) {
+                        fprintf(stderr, "Invalid --pack auto maximum size %dx%d.\n", args->packW, args->packH);
+                        return false;
+                    }
+                }
+            } else {
+                args->packW = atoi(argv[i + 1]);
+                args->packH = atoi(argv[i + 2]);
+                i += 2;
+            }
+        } else if(strcmp(argv[i], "--row-grid") == 0) {
+            args->rowGrid = true;
+        } else if(strcmp(argv[i], "--pages") == 0) {
+            args->pages = true;
+        } else if(strcmp(argv[i], "--rotate") == 0) {
+            args->rotate = true;
+        } else if(strcmp(argv[i], "--seed") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify the metadata of the previous run.\n");
+                return false;
+            }
+
+            args->seed = argv[i + 1];
+            i += 1;
         } else if(strcmp(argv[i], "--pot") == 0) {
             args->pot = true;
 		} else if (strcmp(argv[i], "--label") == 0) {
 			args->label = true;
 		} else if (strcmp(argv[i], "--row-thresh") == 0) {
-			CompareFramesRowThresh = atoi(argv[i + 1]);
+			FrameRowThresh = atoi(argv[i + 1]);
 			i += 1;
+        } else if(strcmp(argv[i], "--encode") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify an encode preset.\n");
+                return false;
+            }
+
+            args->encodePreset = -1;
+
+            for(int k = 0; k < NUM_ENCODE_PRESETS; ++k) {
+                if(strcmp(argv[i + 1], EncodePresets[k].name) == 0) {
+                    args->encodePreset = k;
+                }
+            }
+
+            if(args->encodePreset < 0) {
+                fprintf(stderr, "Unknown encode preset '%s'.\n", argv[i + 1]);
+                return false;
+            }
+
+            i += 1;
+        } else if(strcmp(argv[i], "--rgba") == 0) {
+            args->rgba = true;
+        } else if(strcmp(argv[i], "--benchmark") == 0) {
+            args->benchmark = true;
+        } else if(strcmp(argv[i], "--dirty-rects") == 0) {
+            args->dirtyRects = true;
+        } else if(strcmp(argv[i], "--bench-pack") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify a number of frames.\n");
+                return false;
+            }
+
+            args->benchPack = atoi(argv[i + 1]);
+
+            if(args->benchPack <= 0) {
+                fprintf(stderr, "Invalid number of frames '%s'.\n", argv[i + 1]);
+                return false;
+            }
+
+            i += 1;
+        } else if(strcmp(argv[i], "--etc2") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify an ETC2 mode.\n");
+                return false;
+            }
+
+            if(strcmp(argv[i + 1], "fast") == 0) {
+                args->etc2 = ETC2_FAST;
+            } else if(strcmp(argv[i + 1], "quality") == 0) {
+                args->etc2 = ETC2_QUALITY;
+            } else {
+                fprintf(stderr, "Unknown ETC2 mode '%s'.\n", argv[i + 1]);
+                return false;
+            }
+
+            i += 1;
+        } else if(strcmp(argv[i], "--packer") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify a packer.\n");
+                return false;
+            }
+
+            if(strcmp(argv[i + 1], "skyline") == 0) {
+                args->packer = PACKER_SKYLINE;
+            } else if(strcmp(argv[i + 1], "skyline-bf") == 0) {
+                args->packer = PACKER_SKYLINE_BF;
+            } else if(strcmp(argv[i + 1], "maxrects") == 0) {
+                args->packer = PACKER_MAXRECTS;
+            } else if(strcmp(argv[i + 1], "maxrects-contact") == 0) {
+                args->packer = PACKER_MAXRECTS_CONTACT;
+            } else if(strcmp(argv[i + 1], "shelf") == 0) {
+                args->packer = PACKER_SHELF;
+            } else if(strcmp(argv[i + 1], "best") == 0) {
+                args->packer = PACKER_BEST;
+            } else {
+                fprintf(stderr, "Unknown packer '%s'.\n", argv[i + 1]);
+                return false;
+            }
+
+            i += 1;
+        } else if(strcmp(argv[i], "--pixel-format") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify a pixel format.\n");
+                return false;
+            }
+
+            if(strcmp(argv[i + 1], "rgba8") == 0) {
+                args->pixelFormat = RAW_PIXEL_RGBA8;
+            } else if(strcmp(argv[i + 1], "rgba4444") == 0) {
+                args->pixelFormat = RAW_PIXEL_RGBA4444;
+            } else if(strcmp(argv[i + 1], "rgb565") == 0) {
+                args->pixelFormat = RAW_PIXEL_RGB565;
+            } else if(strcmp(argv[i + 1], "rgba5551") == 0) {
+                args->pixelFormat = RAW_PIXEL_RGBA5551;
+            } else {
+                fprintf(stderr, "Unknown pixel format '%s'.\n", argv[i + 1]);
+                return false;
+            }
+
+            i += 1;
+        } else if(strcmp(argv[i], "--scales") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify the scales.\n");
+                return false;
+            }
+
+            const char* list = argv[i + 1];
+            args->numScales = 0;
+
+            for(;;) {
+                char* end;
+                float scale = strtof(list, &end);
+
+                if(end == list || scale < MIN_SCALE || scale > 1.0f) {
+                    fprintf(stderr, "Invalid scale list '%s'.\n", argv[i + 1]);
+                    return false;
+                }
+
+                if(args->numScales == MAX_SCALES) {
+                    fprintf(stderr, "At most %d scales are supported.\n", MAX_SCALES);
+                    return false;
+                }
+
+                args->scales[args->numScales++] = scale;
+
+                if(*end != ',') break;
+                list = end + 1;
+            }
+
+            i += 1;
+        } else if(strcmp(argv[i], "--dedup") == 0) {
+            args->dedup = true;
+        } else if(strcmp(argv[i], "--dedup-transforms") == 0) {
+            args->dedup = true;
+            args->dedupTransforms = true;
+        } else if(strcmp(argv[i], "--mips") == 0) {
+            args->mips = true;
+        } else if(strcmp(argv[i], "--threads") == 0) {
+            NumThreads = atoi(argv[i + 1]);
+            i += 1;
+        } else if(strcmp(argv[i], "--format") == 0) {
+            if(i + 1 >= argc) {
+                fprintf(stderr, "Please specify an output format.\n");
+                return false;
+            }
+
+            if(strcmp(argv[i + 1], "png") == 0) {
+                args->format = OUTPUT_PNG;
+            } else if(strcmp(argv[i + 1], "qoi") == 0) {
+                args->format = OUTPUT_QOI;
+            } else if(strcmp(argv[i + 1], "raw") == 0) {
+                args->format = OUTPUT_RAW;
+            } else if(strcmp(argv[i + 1], "bc1") == 0) {
+                args->format = OUTPUT_BC1;
+            } else if(strcmp(argv[i + 1], "bc3") == 0) {
+                args->format = OUTPUT_BC3;
+            } else {
+                fprintf(stderr, "Unknown output format '%s'.\n", argv[i + 1]);
+                return false;
+            }
+
+            i += 1;
 		} else {
     		if(!args->inputImage) args->inputImage = argv[i];
     		else if (!args->outputImage) args->outputImage = argv[i];
@@ -221,6 +770,17 @@ static bool ParseArgs(Args* args, int argc, char** argv)
     	}
     }
 
+    if(NumThreads < 1) {
+        NumThreads = 1;
+    } else if(NumThreads > MAX_THREADS) {
+        NumThreads = MAX_THREADS;
+    }
+
+    // The packing benchmark makes up its own frames
+    if(args->benchPack > 0) {
+        return true;
+    }
+
     if (!args->inputImage) {
     	fprintf(stderr, "Please specify an input image.\n");
     	return false;
@@ -256,7 +816,7 @@ static bool ParseArgs(Args* args, int argc, char** argv)
         return false;
     }
 
-    if(args->packW > 0 && args->packH > 0 && args->pot) {
+    if(args->packW > 0 && args->packH > 0 && args->pot && !args->packAuto) {
         fprintf(stderr, "Cannot specify pack width and height and also power of two.\n");
         return false;
     }
@@ -297,10 +857,64 @@ static bool ParseArgs(Args* args, int argc, char** argv)
         args->metadata = true;
     }
 
-	if (CompareFramesRowThresh == 0) {
-		CompareFramesRowThresh = args->fh / 2;
+	if (FrameRowThresh == 0) {
+		FrameRowThresh = args->fh / 2;
 	}
 
+    if(args->rowGrid && args->packW > 0) {
+        fprintf(stderr, "--row-grid is only supported without --pack.\n");
+        return false;
+    }
+
+    if(args->rotate && args->packW == 0) {
+        fprintf(stderr, "--rotate is only supported with --pack.\n");
+        return false;
+    }
+
+    if(args->pages && args->packW == 0) {
+        fprintf(stderr, "--pages is only supported with --pack.\n");
+        return false;
+    }
+
+    if(args->seed && (args->packW == 0 || args->packAuto || args->pages)) {
+        fprintf(stderr, "--seed is only supported with a fixed --pack size and without --pages.\n");
+        return false;
+    }
+
+    if(args->packer != PACKER_SKYLINE && args->packW == 0) {
+        fprintf(stderr, "--packer is only supported with --pack.\n");
+        return false;
+    }
+
+    if(args->benchmark && args->format != OUTPUT_PNG) {
+        fprintf(stderr, "--benchmark is only supported with --format png.\n");
+        return false;
+    }
+
+    if(args->dirtyRects && (args->format == OUTPUT_BC1 || args->format == OUTPUT_BC3)) {
+        fprintf(stderr, "--dirty-rects is only supported with --format png, qoi or raw.\n");
+        return false;
+    }
+
+    if(args->pixelFormat != RAW_PIXEL_RGBA8 && args->format != OUTPUT_RAW) {
+        fprintf(stderr, "--pixel-format is only supported with --format raw.\n");
+        return false;
+    }
+
+    args->packAlign = 1;
+
+    if(args->format == OUTPUT_BC1 || args->format == OUTPUT_BC3 || args->etc2 != ETC2_NONE) {
+        args->packAlign = 4;
+    }
+
+    if(args->mips) {
+        args->packAlign = MIP_ALIGN;
+    }
+
+    if(args->packAlign > 1 && args->packW == 0 && !args->rowGrid && (args->fw % args->packAlign != 0 || args->fh % args->packAlign != 0)) {
+        fprintf(stderr, "Warning: frame size isn't a multiple of %d, so compressed blocks or mip levels will straddle frames.\n", args->packAlign);
+    }
+
     return true;
 }
 
@@ -312,304 +926,5500 @@ static bool PixelEqual(const Pixel* a, const Pixel* b)
            a->a == b->a;
 }
 
-static int CompareFrames(const void* va, const void* vb)
-{
-    const Rect* a = va;
-    const Rect* b = vb;
+// QOI (Quite OK Image) support, see https://qoiformat.org/qoi-specification.pdf
+#define QOI_OP_INDEX 0x00
+#define QOI_OP_DIFF  0x40
+#define QOI_OP_LUMA  0x80
+#define QOI_OP_RUN   0xc0
+#define QOI_OP_RGB   0xfe
+#define QOI_OP_RGBA  0xff
+#define QOI_MASK_2   0xc0
 
-    if(abs(a->y - b->y) < CompareFramesRowThresh) {
-        // They're in the same row, roughly
-        return a->x - b->x;
-    } 
+#define QOI_HEADER_SIZE 14
+#define QOI_PADDING_SIZE 8
 
-    return a->y - b->y;
+#define QOI_HASH(p) (((p).r * 3 + (p).g * 5 + (p).b * 7 + (p).a * 11) % 64)
+
+static const unsigned char QoiPadding[QOI_PADDING_SIZE] = { 0, 0, 0, 0, 0, 0, 0, 1 };
+
+static unsigned int ReadU32BE(const unsigned char* p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
 }
 
-static int NumFrames = 0;
-static Rect Frames[MAX_FRAMES];
+static void WriteU32BE(unsigned char* p, unsigned int v)
+{
+    p[0] = (v >> 24) & 0xff;
+    p[1] = (v >> 16) & 0xff;
+    p[2] = (v >> 8) & 0xff;
+    p[3] = v & 0xff;
+}
 
-static void ExtractFrames(const char* filename, const Args* args)
+static unsigned char* ReadEntireFile(const char* filename, size_t* size)
 {
-    int w, h, n;
-    unsigned char* src = stbi_load(filename, &w, &h, &n, 4);
+    FILE* file = fopen(filename, "rb");
 
-    if(!src) {
-        fprintf(stderr, "Failed to load image '%s': %s\n", filename, stbi_failure_reason());
-		if (args->isDir) {
-			fprintf(stderr, "Skipping...\n");
-		}
-		return;
+    if(!file) {
+        return NULL;
     }
 
-    int fw = args->fw;
-    int fh = args->fh;
-    int maxDistFromEdge = args->maxDistFromEdge;
+    fseek(file, 0, SEEK_END);
+    long len = ftell(file);
+    fseek(file, 0, SEEK_SET);
 
-    // Top left pixel is bg color
-    const Pixel* bg = (Pixel*)src;
+    if(len < 0) {
+        fclose(file);
+        return NULL;
+    }
 
-    printf("Processing image '%s'...\n", filename);
-    printf("image size: %d, %d\n", w, h);
-    printf("bg: %d %d %d %d\n", bg->r, bg->g, bg->b, bg->a);
+    unsigned char* data = malloc(len > 0 ? len : 1);
 
-    bool* checked = calloc(sizeof(bool), w * h);
+    if(data && fread(data, 1, len, file) != (size_t)len) {
+        free(data);
+        data = NULL;
+    }
 
-    for(int y = 0; y < h; ++y) {
-        for(int x = 0; x < w; ++x) {
-            const Pixel* p = (Pixel*)(&src[x * 4 + y * (w * 4)]);
-  
-            if(PixelEqual(p, bg)) {
-                continue;
-            } 
+    fclose(file);
 
-    		if (checked[x + y * w]) continue;
-    		
-            // Flood fill to find extents
-            int minX = INT_MAX;
-            int minY = INT_MAX;
-            int maxX = INT_MIN;
-            int maxY = INT_MIN;
+    *size = (size_t)len;
+    return data;
+}
 
-            int numPoints = 0;
-            static Point points[MAX_POINTS]; 
+static bool IsQoi(const unsigned char* data, size_t size)
+{
+    return size >= QOI_HEADER_SIZE && memcmp(data, "qoif", 4) == 0;
+}
 
-            points[numPoints++] = (Point){ x, y, 0 };
-            
-            while(numPoints > 0) {
-                Point pt = points[numPoints - 1];
-                numPoints -= 1;
+// Always decodes to 4 components, just like the stbi_load call in ExtractFrames
+static unsigned char* QoiDecode(const unsigned char* data, size_t size, int* w, int* h)
+{
+    if(!IsQoi(data, size)) {
+        return NULL;
+    }
 
-    			if (pt.x < 0 || pt.y < 0 || pt.x >= w || pt.y >= h) continue;
-    			if (checked[pt.x + pt.y * w]) continue;
+    unsigned int width = ReadU32BE(data + 4);
+    unsigned int height = ReadU32BE(data + 8);
+    unsigned char channels = data[12];
 
-                p = (Pixel*)(&src[(pt.x * 4) + pt.y * (w * 4)]);
+    if(width == 0 || height == 0 || (channels != 3 && channels != 4) ||
+       height >= 400000000 / width) {
+        return NULL;
+    }
 
-    			bool isBg = PixelEqual(p, bg);
-                if(isBg && pt.distFromEdge >= maxDistFromEdge) {
+    size_t numPixels = (size_t)width * height;
+    Pixel* pixels = malloc(numPixels * sizeof(Pixel));
+
+    if(!pixels) {
+        return NULL;
+    }
+
+    Pixel index[64] = { { 0 } };
+    Pixel px = { 0, 0, 0, 255 };
+
+    size_t p = QOI_HEADER_SIZE;
+    size_t end = size - QOI_PADDING_SIZE;
+    int run = 0;
+
+    for(size_t i = 0; i < numPixels; ++i) {
+        if(run > 0) {
+            run -= 1;
+        } else if(p < end) {
+            unsigned char b1 = data[p++];
+
+            if(b1 == QOI_OP_RGB) {
+                px.r = data[p++];
+                px.g = data[p++];
+                px.b = data[p++];
+            } else if(b1 == QOI_OP_RGBA) {
+                px.r = data[p++];
+                px.g = data[p++];
+                px.b = data[p++];
+                px.a = data[p++];
+            } else if((b1 & QOI_MASK_2) == QOI_OP_INDEX) {
+                px = index[b1];
+            } else if((b1 & QOI_MASK_2) == QOI_OP_DIFF) {
+                px.r += ((b1 >> 4) & 0x03) - 2;
+                px.g += ((b1 >> 2) & 0x03) - 2;
+                px.b += (b1 & 0x03) - 2;
+            } else if((b1 & QOI_MASK_2) == QOI_OP_LUMA) {
+                unsigned char b2 = data[p++];
+                int vg = (b1 & 0x3f) - 32;
+
+                px.r += vg - 8 + ((b2 >> 4) & 0x0f);
+                px.g += vg;
+                px.b += vg - 8 + (b2 & 0x0f);
+            } else {
+                run = b1 & 0x3f;
+            }
+
+            index[QOI_HASH(px)] = px;
+        }
+
+        pixels[i] = px;
+    }
+
+    *w = (int)width;
+    *h = (int)height;
+
+    return (unsigned char*)pixels;
+}
+
+static unsigned char* QoiEncode(const unsigned char* src, int w, int h, int stride, size_t* outLen)
+{
+    size_t maxSize = (size_t)w * h * 5 + QOI_HEADER_SIZE + QOI_PADDING_SIZE;
+    unsigned char* bytes = malloc(maxSize);
+
+    if(!bytes) {
+        return NULL;
+    }
+
+    memcpy(bytes, "qoif", 4);
+    WriteU32BE(bytes + 4, w);
+    WriteU32BE(bytes + 8, h);
+    bytes[12] = 4;
+    bytes[13] = 0;
+
+    size_t p = QOI_HEADER_SIZE;
+
+    Pixel index[64] = { { 0 } };
+    Pixel prev = { 0, 0, 0, 255 };
+    int run = 0;
+
+    for(int y = 0; y < h; ++y) {
+        const Pixel* row = (const Pixel*)(src + (size_t)y * stride);
+
+        for(int x = 0; x < w; ++x) {
+            Pixel px = row[x];
+
+            if(PixelEqual(&px, &prev)) {
+                run += 1;
+
+                if(run == 62) {
+                    bytes[p++] = QOI_OP_RUN | (run - 1);
+                    run = 0;
+                }
+
+                continue;
+            }
+
+            if(run > 0) {
+                bytes[p++] = QOI_OP_RUN | (run - 1);
+                run = 0;
+            }
+
+            int hash = QOI_HASH(px);
+
+            if(PixelEqual(&index[hash], &px)) {
+                bytes[p++] = QOI_OP_INDEX | hash;
+            } else {
+                index[hash] = px;
+
+                if(px.a == prev.a) {
+                    signed char vr = px.r - prev.r;
+                    signed char vg = px.g - prev.g;
+                    signed char vb = px.b - prev.b;
+
+                    signed char vgr = vr - vg;
+                    signed char vgb = vb - vg;
+
+                    if(vr > -3 && vr < 2 && vg > -3 && vg < 2 && vb > -3 && vb < 2) {
+                        bytes[p++] = QOI_OP_DIFF | (vr + 2) << 4 | (vg + 2) << 2 | (vb + 2);
+                    } else if(vgr > -9 && vgr < 8 && vg > -33 && vg < 32 && vgb > -9 && vgb < 8) {
+                        bytes[p++] = QOI_OP_LUMA | (vg + 32);
+                        bytes[p++] = (vgr + 8) << 4 | (vgb + 8);
+                    } else {
+                        bytes[p++] = QOI_OP_RGB;
+                        bytes[p++] = px.r;
+                        bytes[p++] = px.g;
+                        bytes[p++] = px.b;
+                    }
+                } else {
+                    bytes[p++] = QOI_OP_RGBA;
+                    bytes[p++] = px.r;
+                    bytes[p++] = px.g;
+                    bytes[p++] = px.b;
+                    bytes[p++] = px.a;
+                }
+            }
+
+            prev = px;
+        }
+    }
+
+    if(run > 0) {
+        bytes[p++] = QOI_OP_RUN | (run - 1);
+    }
+
+    memcpy(bytes + p, QoiPadding, QOI_PADDING_SIZE);
+    p += QOI_PADDING_SIZE;
+
+    *outLen = p;
+    return bytes;
+}
+
+static bool QoiWrite(const char* filename, const unsigned char* src, int w, int h, int stride)
+{
+    size_t len;
+    unsigned char* bytes = QoiEncode(src, w, h, stride, &len);
+
+    if(!bytes) {
+        return false;
+    }
+
+    FILE* file = fopen(filename, "wb");
+
+    if(!file) {
+        free(bytes);
+        return false;
+    }
+
+    bool ok = fwrite(bytes, 1, len, file) == len;
+
+    ok = (fclose(file) == 0) && ok;
+    free(bytes);
+
+    return ok;
+}
+
+static void WriteU32LE(unsigned char* p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = (v >> 24) & 0xff;
+}
+
+static void WriteU64LE(unsigned char* p, unsigned long long v)
+{
+    WriteU32LE(p, (unsigned int)(v & 0xffffffff));
+    WriteU32LE(p + 4, (unsigned int)(v >> 32));
+}
+
+static unsigned int ReadU32LE(const unsigned char* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((unsigned int)p[3] << 24);
+}
+
+static unsigned long long ReadU64LE(const unsigned char* p)
+{
+    return ReadU32LE(p) | ((unsigned long long)ReadU32LE(p + 4) << 32);
+}
+
+// Conversion to the 16-bit pixel formats with 4x4 ordered dithering on the color channels.
+// Every channel is quantized as (v * max + threshold) / 255, where the threshold comes from the
+// Bayer matrix instead of always being half of 255. Alpha is rounded so edges stay clean.
+static const unsigned char BayerThresholds[4][4] = {
+    { 7, 135, 39, 167 },
+    { 199, 71, 231, 103 },
+    { 55, 183, 23, 151 },
+    { 247, 119, 215, 87 }
+};
+
+typedef struct
+{
+    int bits[4];
+    int shifts[4];
+} PackedLayout;
+
+// Indexed by RawPixelFormat, RGBA8 is written as is
+static const PackedLayout PackedLayouts[] = {
+    { { 0, 0, 0, 0 }, { 0, 0, 0, 0 } },
+    { { 4, 4, 4, 4 }, { 12, 8, 4, 0 } },
+    { { 5, 6, 5, 0 }, { 11, 5, 0, 0 } },
+    { { 5, 5, 5, 1 }, { 11, 6, 1, 0 } }
+};
+
+static int RawBytesPerPixel(RawPixelFormat format)
+{
+    return format == RAW_PIXEL_RGBA8 ? 4 : 2;
+}
+
+static int QuantizeChannel(int v, int bits, int threshold)
+{
+    return (v * ((1 << bits) - 1) + threshold) / 255;
+}
+
+typedef struct
+{
+    const unsigned char* src;
+    int w, stride;
+    const PackedLayout* layout;
+    unsigned char* out;
+} PackedConverter;
+
+static void ConvertPackedRow(void* data, int y, int thread)
+{
+    PackedConverter* conv = data;
+    const PackedLayout* layout = conv->layout;
+    const unsigned char* row = conv->src + (size_t)y * conv->stride;
+    unsigned char* out = conv->out + (size_t)y * conv->w * 2;
+
+    (void)thread;
+
+    int x = 0;
+
+#ifdef USE_SSE2
+    const __m128i byteMask = _mm_set1_epi32(0xff);
+    const __m128i one = _mm_set1_epi16(1);
+    const __m128i thresholds = _mm_setr_epi16(BayerThresholds[y & 3][0], BayerThresholds[y & 3][1],
+                                              BayerThresholds[y & 3][2], BayerThresholds[y & 3][3],
+                                              BayerThresholds[y & 3][0], BayerThresholds[y & 3][1],
+                                              BayerThresholds[y & 3][2], BayerThresholds[y & 3][3]);
+
+    for(; x + 8 <= conv->w; x += 8) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(row + x * 4));
+        __m128i b = _mm_loadu_si128((const __m128i*)(row + x * 4 + 16));
+        __m128i packed = _mm_setzero_si128();
+
+        for(int c = 0; c < 4; ++c) {
+            if(layout->bits[c] == 0) continue;
+
+            // Channel c of the 8 pixels as 16-bit lanes
+            __m128i lo = _mm_and_si128(_mm_srli_epi32(a, c * 8), byteMask);
+            __m128i hi = _mm_and_si128(_mm_srli_epi32(b, c * 8), byteMask);
+            __m128i v = _mm_packs_epi32(lo, hi);
+
+            __m128i t = c == 3 ? _mm_set1_epi16(127) : thresholds;
+            v = _mm_add_epi16(_mm_mullo_epi16(v, _mm_set1_epi16((short)((1 << layout->bits[c]) - 1))), t);
+
+            // Exact division by 255 for values below 65535
+            v = _mm_srli_epi16(_mm_add_epi16(_mm_add_epi16(v, one), _mm_srli_epi16(v, 8)), 8);
+
+            packed = _mm_or_si128(packed, _mm_sll_epi16(v, _mm_cvtsi32_si128(layout->shifts[c])));
+        }
+
+        _mm_storeu_si128((__m128i*)(out + x * 2), packed);
+    }
+#endif
+
+    for(; x < conv->w; ++x) {
+        const unsigned char* p = row + x * 4;
+        int threshold = BayerThresholds[y & 3][x & 3];
+        unsigned int v = 0;
+
+        for(int c = 0; c < 4; ++c) {
+            if(layout->bits[c] == 0) continue;
+
+            v |= (unsigned int)QuantizeChannel(p[c], layout->bits[c], c == 3 ? 127 : threshold) << layout->shifts[c];
+        }
+
+        out[x * 2] = v & 0xff;
+        out[x * 2 + 1] = (v >> 8) & 0xff;
+    }
+}
+
+// Returns the image converted to a 16-bit format, rows tightly packed
+static unsigned char* ConvertToPacked(const unsigned char* src, int w, int h, int stride, RawPixelFormat format)
+{
+    PackedConverter conv;
+
+    conv.src = src;
+    conv.w = w;
+    conv.stride = stride;
+    conv.layout = &PackedLayouts[format];
+    conv.out = malloc((size_t)w * h * 2);
+
+    if(conv.out) {
+        ParallelFor(h, ConvertPackedRow, &conv);
+    }
+
+    return conv.out;
+}
+
+// One entry of the raw frame table. transform is the metadata's transform column (see --dedup-transforms)
+// and page the page the frame's pixels are on (always 0 without --pages).
+typedef struct
+{
+    int x, y, w, h;
+    int transform;
+    int page;
+} RawFrame;
+
+#define RAW_FRAME_SIZE 24
+
+// For mip level files (level > 0) the frame table is scaled down to match
+static bool RawWrite(const char* filename, const unsigned char* src, int w, int h, int stride, RawPixelFormat format,
+                     const RawFrame* rects, int numRects, int level)
+{
+    unsigned int rowPitch = (unsigned int)w * RawBytesPerPixel(format);
+    unsigned int frameTableOffset = RAW_HEADER_SIZE;
+    unsigned int frameTableSize = (unsigned int)numRects * RAW_FRAME_SIZE;
+
+    unsigned long long pixelDataOffset = frameTableOffset + frameTableSize;
+    pixelDataOffset = (pixelDataOffset + RAW_ALIGNMENT - 1) / RAW_ALIGNMENT * RAW_ALIGNMENT;
+
+    unsigned long long pixelDataSize = (unsigned long long)rowPitch * h;
+
+    // 16-bit formats are converted up front so the rows below can be written as is
+    unsigned char* converted = NULL;
+
+    if(format != RAW_PIXEL_RGBA8) {
+        converted = ConvertToPacked(src, w, h, stride, format);
+
+        if(!converted) {
+            return false;
+        }
+
+        src = converted;
+        stride = (int)rowPitch;
+    }
+
+    // Header and frame table are small, so build them (and the padding) in memory
+    size_t prefixSize = (size_t)pixelDataOffset;
+    unsigned char* prefix = calloc(1, prefixSize);
+
+    if(!prefix) {
+        free(converted);
+        return false;
+    }
+
+    memcpy(prefix, "SPXA", 4);
+    WriteU32LE(prefix + 4, RAW_VERSION);
+    WriteU32LE(prefix + 8, w);
+    WriteU32LE(prefix + 12, h);
+    WriteU32LE(prefix + 16, format);
+    WriteU32LE(prefix + 20, rowPitch);
+    WriteU32LE(prefix + 24, numRects);
+    WriteU32LE(prefix + 28, frameTableOffset);
+    WriteU64LE(prefix + 32, pixelDataOffset);
+    WriteU64LE(prefix + 40, pixelDataSize);
+
+    for(int i = 0; i < numRects; ++i) {
+        unsigned char* entry = prefix + frameTableOffset + i * RAW_FRAME_SIZE;
+
+        int round = (1 << level) - 1;
+
+        WriteU32LE(entry, rects[i].x >> level);
+        WriteU32LE(entry + 4, rects[i].y >> level);
+        WriteU32LE(entry + 8, ((rects[i].x + rects[i].w + round) >> level) - (rects[i].x >> level));
+        WriteU32LE(entry + 12, ((rects[i].y + rects[i].h + round) >> level) - (rects[i].y >> level));
+        WriteU32LE(entry + 16, rects[i].transform);
+        WriteU32LE(entry + 20, rects[i].page);
+    }
+
+    FILE* file = fopen(filename, "wb");
+
+    if(!file) {
+        free(prefix);
+        free(converted);
+        return false;
+    }
+
+    bool ok = fwrite(prefix, 1, prefixSize, file) == prefixSize;
+
+    for(int y = 0; ok && y < h; ++y) {
+        ok = fwrite(src + (size_t)y * stride, 1, rowPitch, file) == rowPitch;
+    }
+
+    ok = (fclose(file) == 0) && ok;
+    free(prefix);
+    free(converted);
+
+    return ok;
+}
+
+// PNG writer with its own deflate implementation. Rows are filtered in bands and every band is
+// compressed independently on the thread pool. Each compressed piece ends on a byte boundary
+// (a sync flush, just like pigz) so they can be concatenated into a single zlib stream.
+
+// Roughly how much filtered data goes into each independently compressed piece
+#define PNG_BAND_SIZE (256 * 1024)
+
+// How many bands are filtered and compressed before they're written out, which bounds memory use
+#define PNG_BATCH_BANDS 16
+
+static const unsigned short DeflateLengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+};
+
+static const unsigned char DeflateLengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0
+};
+
+static const unsigned short DeflateDistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073,
+    4097, 6145, 8193, 12289, 16385, 24577
+};
+
+static const unsigned char DeflateDistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// Fixed huffman codes (already bit-reversed) and lookup tables, filled in by InitDeflateTables
+static unsigned short FixedLitCode[288];
+static unsigned char FixedLitBits[288];
+static unsigned char FixedDistCode[30];
+static unsigned char LengthToCode[DEFLATE_MAX_MATCH + 1];
+static unsigned char DistToCode[512];
+
+static unsigned int Crc32Table[256];
+
+static unsigned int ReverseBits(unsigned int code, int bits)
+{
+    unsigned int result = 0;
+
+    for(int i = 0; i < bits; ++i) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+
+    return result;
+}
+
+static void InitDeflateTables(void)
+{
+    for(int i = 0; i < 288; ++i) {
+        if(i < 144) {
+            FixedLitCode[i] = ReverseBits(0x30 + i, 8);
+            FixedLitBits[i] = 8;
+        } else if(i < 256) {
+            FixedLitCode[i] = ReverseBits(0x190 + (i - 144), 9);
+            FixedLitBits[i] = 9;
+        } else if(i < 280) {
+            FixedLitCode[i] = ReverseBits(i - 256, 7);
+            FixedLitBits[i] = 7;
+        } else {
+            FixedLitCode[i] = ReverseBits(0xc0 + (i - 280), 8);
+            FixedLitBits[i] = 8;
+        }
+    }
+
+    for(int i = 0; i < 30; ++i) {
+        FixedDistCode[i] = ReverseBits(i, 5);
+    }
+
+    for(int code = 0; code < 29; ++code) {
+        int end = code < 28 ? DeflateLengthBase[code + 1] : DEFLATE_MAX_MATCH + 1;
+
+        for(int len = DeflateLengthBase[code]; len < end; ++len) {
+            LengthToCode[len] = code;
+        }
+    }
+
+    // Distances up to 256 are looked up directly, the rest by (dist - 1) >> 7
+    for(int code = 0; code < 30; ++code) {
+        int end = code < 29 ? DeflateDistBase[code + 1] : DEFLATE_WINDOW_SIZE + 1;
+
+        for(int dist = DeflateDistBase[code]; dist < end; ++dist) {
+            if(dist <= 256) {
+                DistToCode[dist - 1] = code;
+            } else {
+                DistToCode[256 + ((dist - 1) >> 7)] = code;
+            }
+        }
+    }
+
+    for(unsigned int i = 0; i < 256; ++i) {
+        unsigned int c = i;
+
+        for(int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+
+        Crc32Table[i] = c;
+    }
+}
+
+static unsigned int Crc32Update(unsigned int crc, const unsigned char* data, size_t len)
+{
+    crc = ~crc;
+
+    for(size_t i = 0; i < len; ++i) {
+        crc = Crc32Table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return ~crc;
+}
+
+#define ADLER_BASE 65521
+
+static unsigned int Adler32Update(unsigned int adler, const unsigned char* data, size_t len)
+{
+    unsigned int a = adler & 0xffff;
+    unsigned int b = adler >> 16;
+
+    while(len > 0) {
+        // 5552 is the largest block that can't overflow before the modulo
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+
+        for(; n >= 8; n -= 8, data += 8) {
+            a += data[0]; b += a;
+            a += data[1]; b += a;
+            a += data[2]; b += a;
+            a += data[3]; b += a;
+            a += data[4]; b += a;
+            a += data[5]; b += a;
+            a += data[6]; b += a;
+            a += data[7]; b += a;
+        }
+
+        while(n-- > 0) {
+            a += *data++;
+            b += a;
+        }
+
+        a %= ADLER_BASE;
+        b %= ADLER_BASE;
+    }
+
+    return a | (b << 16);
+}
+
+// Same as adler32_combine in zlib: the checksum of A followed by B, given both checksums and len(B)
+static unsigned int Adler32Combine(unsigned int adler1, unsigned int adler2, size_t len2)
+{
+    unsigned int rem = (unsigned int)(len2 % ADLER_BASE);
+    unsigned int sum1 = adler1 & 0xffff;
+    unsigned int sum2 = (unsigned int)(((unsigned long long)rem * sum1) % ADLER_BASE);
+
+    sum1 += (adler2 & 0xffff) + ADLER_BASE - 1;
+    sum2 += (adler1 >> 16) + (adler2 >> 16) + ADLER_BASE - rem;
+
+    if(sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if(sum1 >= ADLER_BASE) sum1 -= ADLER_BASE;
+    if(sum2 >= 2 * ADLER_BASE) sum2 -= 2 * ADLER_BASE;
+    if(sum2 >= ADLER_BASE) sum2 -= ADLER_BASE;
+
+    return sum1 | (sum2 << 16);
+}
+
+typedef struct
+{
+    unsigned char* data;
+    size_t len;
+
+    unsigned long long bitBuf;
+    int bitCount;
+} BitWriter;
+
+// Bits are flushed 32 at a time; count must be at most 32
+static void PutBits(BitWriter* bw, unsigned int value, int count)
+{
+    bw->bitBuf |= (unsigned long long)value << bw->bitCount;
+    bw->bitCount += count;
+
+    if(bw->bitCount >= 32) {
+        unsigned char* out = bw->data + bw->len;
+
+        out[0] = (unsigned char)bw->bitBuf;
+        out[1] = (unsigned char)(bw->bitBuf >> 8);
+        out[2] = (unsigned char)(bw->bitBuf >> 16);
+        out[3] = (unsigned char)(bw->bitBuf >> 24);
+
+        bw->len += 4;
+        bw->bitBuf >>= 32;
+        bw->bitCount -= 32;
+    }
+}
+
+// Pads with zero bits to a byte boundary and writes out everything that's buffered
+static void AlignToByte(BitWriter* bw)
+{
+    while(bw->bitCount > 0) {
+        bw->data[bw->len++] = (unsigned char)bw->bitBuf;
+        bw->bitBuf >>= 8;
+        bw->bitCount = bw->bitCount > 8 ? bw->bitCount - 8 : 0;
+    }
+
+    bw->bitBuf = 0;
+}
+
+// Worst case size of a piece: every byte as a 9 bit literal plus block headers and the sync flush
+static size_t DeflateBound(size_t len)
+{
+    return len + len / 8 + 16;
+}
+
+typedef struct
+{
+    int head[DEFLATE_HASH_SIZE];
+    int prev[DEFLATE_WINDOW_SIZE];
+} DeflateScratch;
+
+static unsigned int DeflateHash(const unsigned char* p)
+{
+    unsigned int v = ((unsigned int)p[0] << 16) | ((unsigned int)p[1] << 8) | p[2];
+    return (v * 2654435761u) >> (32 - DEFLATE_HASH_BITS);
+}
+
+static void DeflateInsert(DeflateScratch* scratch, const unsigned char* data, int pos)
+{
+    unsigned int h = DeflateHash(data + pos);
+
+    scratch->prev[pos & DEFLATE_WINDOW_MASK] = scratch->head[h];
+    scratch->head[h] = pos;
+}
+
+// Length of the common prefix of a and b, compared 8 bytes at a time where possible
+static int MatchLength(const unsigned char* a, const unsigned char* b, int len, int maxLen)
+{
+    while(len + 8 <= maxLen) {
+        unsigned long long va, vb;
+
+        memcpy(&va, a + len, 8);
+        memcpy(&vb, b + len, 8);
+
+        if(va != vb) {
+            break;
+        }
+
+        len += 8;
+    }
+
+    while(len < maxLen && a[len] == b[len]) {
+        len += 1;
+    }
+
+    return len;
+}
+
+static int DeflateFindMatch(const DeflateScratch* scratch, const unsigned char* data, int pos, int end, int maxChain, int* dist)
+{
+    int maxLen = end - pos;
+
+    if(maxLen > DEFLATE_MAX_MATCH) {
+        maxLen = DEFLATE_MAX_MATCH;
+    }
+
+    if(maxLen < DEFLATE_MIN_MATCH) {
+        return 0;
+    }
+
+    int bestLen = DEFLATE_MIN_MATCH - 1;
+    int limit = pos - DEFLATE_WINDOW_SIZE;
+
+    const unsigned char* p = data + pos;
+    int cand = scratch->head[DeflateHash(p)];
+
+    while(cand > limit && cand >= 0 && maxChain-- > 0) {
+        const unsigned char* c = data + cand;
+
+        if(c[bestLen] == p[bestLen] && c[0] == p[0] && c[1] == p[1]) {
+            int len = MatchLength(c, p, 2, maxLen);
+
+            if(len > bestLen) {
+                bestLen = len;
+                *dist = pos - cand;
+
+                if(len == maxLen) {
+                    break;
+                }
+            }
+        }
+
+        int next = scratch->prev[cand & DEFLATE_WINDOW_MASK];
+
+        // Slots get recycled once a position leaves the window, so the chain must keep going backwards
+        if(next >= cand) {
+            break;
+        }
+
+        cand = next;
+    }
+
+    return bestLen >= DEFLATE_MIN_MATCH ? bestLen : 0;
+}
+
+static void PutLiteral(BitWriter* bw, unsigned char c)
+{
+    PutBits(bw, FixedLitCode[c], FixedLitBits[c]);
+}
+
+static void PutMatch(BitWriter* bw, int len, int dist)
+{
+    int lc = LengthToCode[len];
+
+    PutBits(bw, FixedLitCode[257 + lc], FixedLitBits[257 + lc]);
+    PutBits(bw, len - DeflateLengthBase[lc], DeflateLengthExtra[lc]);
+
+    int dc = dist <= 256 ? DistToCode[dist - 1] : DistToCode[256 + ((dist - 1) >> 7)];
+
+    PutBits(bw, FixedDistCode[dc], 5);
+    PutBits(bw, dist - DeflateDistBase[dc], DeflateDistExtra[dc]);
+}
+
+// Makes every position before pos (that has enough bytes after it) findable by the match finder
+static void DeflateInsertUpTo(DeflateScratch* scratch, const unsigned char* data, int* inserted, int pos, int end)
+{
+    for(; *inserted < pos; *inserted += 1) {
+        if(*inserted + DEFLATE_MIN_MATCH <= end) {
+            DeflateInsert(scratch, data, *inserted);
+        }
+    }
+}
+
+// Compresses data[dictLen, dictLen + len) as a single fixed huffman block. The first dictLen bytes
+// are only used as history for matches, which keeps most of the ratio of a serial compressor.
+// Unless this is the last piece of the stream, it's finished with an empty stored block so that
+// the output ends on a byte boundary.
+static void DeflatePiece(BitWriter* bw, DeflateScratch* scratch, const unsigned char* data, int dictLen, int len,
+                         const EncodeSettings* settings, bool last)
+{
+    for(int i = 0; i < DEFLATE_HASH_SIZE; ++i) {
+        scratch->head[i] = -1;
+    }
+
+    int end = dictLen + len;
+    int inserted = 0;
+
+    PutBits(bw, last ? 1 : 0, 1);
+    PutBits(bw, 1, 2);
+
+    int i = dictLen;
+
+    while(i < end) {
+        DeflateInsertUpTo(scratch, data, &inserted, i, end);
+
+        int dist = 0;
+        int matchLen = DeflateFindMatch(scratch, data, i, end, settings->maxChain, &dist);
+
+        // Lazy matching: emit a literal instead if the next position has a longer match
+        while(settings->lazy && matchLen > 0 && matchLen < DEFLATE_MAX_MATCH && i + 1 < end) {
+            DeflateInsertUpTo(scratch, data, &inserted, i + 1, end);
+
+            int nextDist = 0;
+            int nextLen = DeflateFindMatch(scratch, data, i + 1, end, settings->maxChain, &nextDist);
+
+            if(nextLen <= matchLen) {
+                break;
+            }
+
+            PutLiteral(bw, data[i]);
+
+            i += 1;
+            matchLen = nextLen;
+            dist = nextDist;
+        }
+
+        if(matchLen == 0) {
+            PutLiteral(bw, data[i]);
+            i += 1;
+            continue;
+        }
+
+        PutMatch(bw, matchLen, dist);
+        i += matchLen;
+
+        // Skipping the insertion of the inside of long matches is much faster and costs little
+        if(matchLen > settings->maxInsertLen) {
+            inserted = i;
+        }
+    }
+
+    // End of block
+    PutBits(bw, FixedLitCode[256], FixedLitBits[256]);
+
+    if(!last) {
+        // Sync flush: empty stored block, which also pads to a byte boundary
+        PutBits(bw, 0, 3);
+        AlignToByte(bw);
+
+        PutBits(bw, 0x00, 8);
+        PutBits(bw, 0x00, 8);
+        PutBits(bw, 0xff, 8);
+        PutBits(bw, 0xff, 8);
+    } else {
+        AlignToByte(bw);
+    }
+}
+
+static unsigned char PngPaeth(int a, int b, int c)
+{
+    int p = a + b - c;
+    int pa = abs(p - a);
+    int pb = abs(p - b);
+    int pc = abs(p - c);
+
+    if(pa <= pb && pa <= pc) return (unsigned char)a;
+    if(pb <= pc) return (unsigned char)b;
+    return (unsigned char)c;
+}
+
+// Filters a single row into out (rowBytes bytes, not including the filter type byte).
+// prevRow is NULL for the first row of the image.
+static void PngFilterRow(unsigned char* out, const unsigned char* row, const unsigned char* prevRow, int rowBytes, int bpp, int filter)
+{
+    if(filter == 0) {
+        memcpy(out, row, rowBytes);
+        return;
+    }
+
+    int i = 0;
+
+    // The first pixel has no left neighbour
+    for(; i < bpp && i < rowBytes; ++i) {
+        int b = prevRow ? prevRow[i] : 0;
+
+        switch(filter) {
+            case 1: out[i] = row[i]; break;
+            case 2: out[i] = (unsigned char)(row[i] - b); break;
+            case 3: out[i] = (unsigned char)(row[i] - (b >> 1)); break;
+            case 4: out[i] = (unsigned char)(row[i] - b); break;
+        }
+    }
+
+    if(filter == 1) {
+        for(; i < rowBytes; ++i) {
+            out[i] = (unsigned char)(row[i] - row[i - bpp]);
+        }
+    } else if(!prevRow) {
+        // Up is zero, so average only uses the left neighbour and paeth always picks it
+        for(; i < rowBytes; ++i) {
+            switch(filter) {
+                case 2: out[i] = row[i]; break;
+                case 3: out[i] = (unsigned char)(row[i] - (row[i - bpp] >> 1)); break;
+                case 4: out[i] = (unsigned char)(row[i] - row[i - bpp]); break;
+            }
+        }
+    } else if(filter == 2) {
+        for(; i < rowBytes; ++i) {
+            out[i] = (unsigned char)(row[i] - prevRow[i]);
+        }
+    } else if(filter == 3) {
+        for(; i < rowBytes; ++i) {
+            out[i] = (unsigned char)(row[i] - ((row[i - bpp] + prevRow[i]) >> 1));
+        }
+    } else {
+        for(; i < rowBytes; ++i) {
+            out[i] = (unsigned char)(row[i] - PngPaeth(row[i - bpp], prevRow[i], prevRow[i - bpp]));
+        }
+    }
+}
+
+static int PngFilterCost(const unsigned char* filtered, int rowBytes)
+{
+    int cost = 0;
+
+    for(int i = 0; i < rowBytes; ++i) {
+        cost += abs((signed char)filtered[i]);
+    }
+
+    return cost;
+}
+
+// Unless the settings force a filter, picks the one with the lowest sum of absolute values, which
+// is the heuristic libpng and stb_image_write use. out must have room for the filter type byte plus the row.
+static void PngEncodeRow(unsigned char* out, unsigned char* scratch, const unsigned char* row, const unsigned char* prevRow,
+                         int rowBytes, int bpp, const EncodeSettings* settings)
+{
+    if(settings->filter >= 0) {
+        out[0] = (unsigned char)settings->filter;
+        PngFilterRow(out + 1, row, prevRow, rowBytes, bpp, settings->filter);
+        return;
+    }
+
+    int bestFilter = 0;
+    int bestCost = INT_MAX;
+
+    for(int filter = 0; filter < 5; ++filter) {
+        PngFilterRow(scratch, row, prevRow, rowBytes, bpp, filter);
+
+        int cost = PngFilterCost(scratch, rowBytes);
+
+        if(cost < bestCost) {
+            bestCost = cost;
+            bestFilter = filter;
+        }
+    }
+
+    out[0] = (unsigned char)bestFilter;
+    PngFilterRow(out + 1, row, prevRow, rowBytes, bpp, bestFilter);
+}
+
+// Atlases with at most 256 distinct colors are written as indexed PNGs
+#define PALETTE_HASH_SIZE 1024
+
+typedef struct
+{
+    int numColors;
+    int numTranslucent;
+    Pixel colors[256];
+
+    // Open addressing table from color to palette index, -1 for empty slots
+    unsigned int keys[PALETTE_HASH_SIZE];
+    short indices[PALETTE_HASH_SIZE];
+
+    int bitDepth;
+} Palette;
+
+static unsigned int PixelKey(const Pixel* p)
+{
+    return ((unsigned int)p->r << 24) | ((unsigned int)p->g << 16) | ((unsigned int)p->b << 8) | p->a;
+}
+
+static int PaletteSlot(const Palette* pal, unsigned int key)
+{
+    unsigned int slot = (key * 2654435761u) >> 22;
+
+    while(pal->indices[slot] >= 0 && pal->keys[slot] != key) {
+        slot = (slot + 1) & (PALETTE_HASH_SIZE - 1);
+    }
+
+    return (int)slot;
+}
+
+// Returns false if the image has more than 256 colors
+static bool BuildPalette(Palette* pal, const unsigned char* src, int w, int h, int stride)
+{
+    pal->numColors = 0;
+
+    for(int i = 0; i < PALETTE_HASH_SIZE; ++i) {
+        pal->indices[i] = -1;
+    }
+
+    for(int y = 0; y < h; ++y) {
+        const Pixel* row = (const Pixel*)(src + (size_t)y * stride);
+        unsigned int lastKey = 0;
+        bool hasLast = false;
+
+        for(int x = 0; x < w; ++x) {
+            unsigned int key = PixelKey(&row[x]);
+
+            // Atlases are mostly runs of the same color, so skip the lookup for those
+            if(hasLast && key == lastKey) continue;
+
+            lastKey = key;
+            hasLast = true;
+
+            int slot = PaletteSlot(pal, key);
+
+            if(pal->indices[slot] >= 0) continue;
+
+            if(pal->numColors == 256) {
+                return false;
+            }
+
+            pal->keys[slot] = key;
+            pal->indices[slot] = (short)pal->numColors;
+            pal->colors[pal->numColors++] = row[x];
+        }
+    }
+
+    // Translucent colors go first so the tRNS chunk can stop at the last one of them
+    Pixel sorted[256];
+    int n = 0;
+
+    for(int i = 0; i < pal->numColors; ++i) {
+        if(pal->colors[i].a != 255) sorted[n++] = pal->colors[i];
+    }
+
+    pal->numTranslucent = n;
+
+    for(int i = 0; i < pal->numColors; ++i) {
+        if(pal->colors[i].a == 255) sorted[n++] = pal->colors[i];
+    }
+
+    for(int i = 0; i < pal->numColors; ++i) {
+        pal->colors[i] = sorted[i];
+        pal->indices[PaletteSlot(pal, PixelKey(&sorted[i]))] = (short)i;
+    }
+
+    if(pal->numColors <= 2) {
+        pal->bitDepth = 1;
+    } else if(pal->numColors <= 4) {
+        pal->bitDepth = 2;
+    } else if(pal->numColors <= 16) {
+        pal->bitDepth = 4;
+    } else {
+        pal->bitDepth = 8;
+    }
+
+    return true;
+}
+
+// Converts a row of RGBA pixels into packed palette indices
+static void PaletteEncodeRow(const Palette* pal, const Pixel* row, int w, unsigned char* out)
+{
+    int perByte = 8 / pal->bitDepth;
+    int rowBytes = (w + perByte - 1) / perByte;
+
+    memset(out, 0, rowBytes);
+
+    for(int x = 0; x < w; ++x) {
+        int index = pal->indices[PaletteSlot(pal, PixelKey(&row[x]))];
+        int shift = 8 - pal->bitDepth * (x % perByte + 1);
+
+        out[x / perByte] |= (unsigned char)(index << shift);
+    }
+}
+
+// Rows are handled a batch of bands at a time. Each batch is filtered and compressed in parallel
+// and then written out as its own IDAT chunk, so only the current batch (plus the 32K dictionary
+// carried over from the previous one) is ever in memory, no matter how large the image is.
+typedef struct
+{
+    const unsigned char* src;
+    int w, h, stride;
+
+    // Bytes per complete pixel (at least 1) as used by the filters, and bytes per encoded row
+    int bpp;
+    int rowBytes;
+
+    // If this is set, src is still RGBA but rows are written as palette indices
+    const Palette* palette;
+
+    const EncodeSettings* settings;
+
+    int bandRows;
+    int numBands;
+    size_t filteredRowBytes;
+
+    // Bands [firstBand, firstBand + batchBands) are in the window right after dictLen bytes of history
+    int firstBand;
+    int batchBands;
+    unsigned char* window;
+    size_t dictLen;
+
+    BitWriter* pieces;
+    unsigned int* adlers;
+
+    DeflateScratch* scratch[MAX_THREADS];
+    unsigned char* rowScratch[MAX_THREADS];
+    unsigned char* indexRow[MAX_THREADS];
+} PngEncoder;
+
+static int PngBandEnd(const PngEncoder* enc, int band)
+{
+    int y1 = (band + 1) * enc->bandRows;
+    return y1 < enc->h ? y1 : enc->h;
+}
+
+static void PngFilterBand(void* data, int index, int thread)
+{
+    PngEncoder* enc = data;
+
+    int band = enc->firstBand + index;
+    int y0 = band * enc->bandRows;
+    int y1 = PngBandEnd(enc, band);
+
+    unsigned char* out = enc->window + enc->dictLen + (size_t)(index * enc->bandRows) * enc->filteredRowBytes;
+
+    for(int y = y0; y < y1; ++y) {
+        const unsigned char* row = enc->src + (size_t)y * enc->stride;
+        const unsigned char* prevRow = y > 0 ? row - enc->stride : NULL;
+
+        if(enc->palette) {
+            // Indexed rows always use the None filter so the previous row isn't needed
+            PaletteEncodeRow(enc->palette, (const Pixel*)row, enc->w, enc->indexRow[thread]);
+
+            row = enc->indexRow[thread];
+            prevRow = NULL;
+        }
+
+        PngEncodeRow(out, enc->rowScratch[thread], row, prevRow, enc->rowBytes, enc->bpp, enc->settings);
+        out += enc->filteredRowBytes;
+    }
+}
+
+static void PngDeflateBand(void* data, int index, int thread)
+{
+    PngEncoder* enc = data;
+
+    int band = enc->firstBand + index;
+    int y0 = band * enc->bandRows;
+    int y1 = PngBandEnd(enc, band);
+
+    size_t offset = enc->dictLen + (size_t)(index * enc->bandRows) * enc->filteredRowBytes;
+    int len = (int)((y1 - y0) * enc->filteredRowBytes);
+
+    // Whatever precedes the band in the window (the previous band or the carried over history) is the dictionary
+    int dictLen = (int)(offset < DEFLATE_WINDOW_SIZE ? offset : DEFLATE_WINDOW_SIZE);
+
+    BitWriter* bw = &enc->pieces[index];
+
+    bw->len = 0;
+    bw->bitBuf = 0;
+    bw->bitCount = 0;
+
+    DeflatePiece(bw, enc->scratch[thread], enc->window + offset - dictLen, dictLen, len, enc->settings, band == enc->numBands - 1);
+
+    enc->adlers[index] = Adler32Update(1, enc->window + offset, len);
+}
+
+static void WritePngChunkHeader(FILE* file, const char* type, unsigned int len, unsigned int* crc)
+{
+    unsigned char header[8];
+
+    WriteU32BE(header, len);
+    memcpy(header + 4, type, 4);
+
+    fwrite(header, 1, 8, file);
+
+    *crc = Crc32Update(0, header + 4, 4);
+}
+
+static void WritePngChunkData(FILE* file, const unsigned char* data, size_t len, unsigned int* crc)
+{
+    fwrite(data, 1, len, file);
+    *crc = Crc32Update(*crc, data, len);
+}
+
+static void WritePngChunkEnd(FILE* file, unsigned int crc)
+{
+    unsigned char bytes[4];
+    WriteU32BE(bytes, crc);
+
+    fwrite(bytes, 1, 4, file);
+}
+
+// Writes src (RGBA) as an indexed PNG if allowPalette is set and it has 256 colors or fewer
+static bool PngWrite(const char* filename, const unsigned char* src, int w, int h, int stride, const EncodeSettings* settings,
+                     bool allowPalette)
+{
+    PngEncoder enc = { 0 };
+
+    // Heap allocated so several images can be written at once
+    Palette* palette = allowPalette ? malloc(sizeof(Palette)) : NULL;
+    EncodeSettings indexedSettings;
+
+    enc.src = src;
+    enc.w = w;
+    enc.h = h;
+    enc.stride = stride;
+    enc.settings = settings;
+
+    if(palette && BuildPalette(palette, src, w, h, stride)) {
+        int perByte = 8 / palette->bitDepth;
+
+        enc.palette = palette;
+        enc.bpp = 1;
+        enc.rowBytes = (w + perByte - 1) / perByte;
+
+        indexedSettings = *settings;
+        indexedSettings.filter = 0;
+
+        enc.settings = &indexedSettings;
+    } else {
+        enc.bpp = 4;
+        enc.rowBytes = w * 4;
+    }
+
+    enc.filteredRowBytes = (size_t)enc.rowBytes + 1;
+    enc.bandRows = (int)(PNG_BAND_SIZE / enc.filteredRowBytes);
+
+    if(enc.bandRows < 1) {
+        enc.bandRows = 1;
+    }
+
+    enc.numBands = (h + enc.bandRows - 1) / enc.bandRows;
+
+    // The batch size doesn't depend on the thread count so the output is identical for any --threads
+    int maxBatchBands = PNG_BATCH_BANDS;
+
+    if(maxBatchBands > enc.numBands) {
+        maxBatchBands = enc.numBands;
+    }
+
+    size_t bandBytes = enc.bandRows * enc.filteredRowBytes;
+
+    enc.window = malloc(DEFLATE_WINDOW_SIZE + bandBytes * maxBatchBands);
+    enc.pieces = calloc(maxBatchBands, sizeof(BitWriter));
+    enc.adlers = calloc(maxBatchBands, sizeof(unsigned int));
+
+    bool ok = enc.window && enc.pieces && enc.adlers;
+
+    for(int i = 0; ok && i < maxBatchBands; ++i) {
+        enc.pieces[i].data = malloc(DeflateBound(bandBytes));
+        ok = enc.pieces[i].data != NULL;
+    }
+
+    for(int t = 0; ok && t < NumThreads; ++t) {
+        enc.scratch[t] = malloc(sizeof(DeflateScratch));
+        enc.rowScratch[t] = malloc(enc.rowBytes);
+        enc.indexRow[t] = malloc(enc.rowBytes);
+
+        ok = enc.scratch[t] && enc.rowScratch[t] && enc.indexRow[t];
+    }
+
+    FILE* file = ok ? fopen(filename, "wb") : NULL;
+
+    if(file) {
+        static const unsigned char signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+        fwrite(signature, 1, 8, file);
+
+        unsigned int crc;
+
+        unsigned char ihdr[13];
+        WriteU32BE(ihdr, w);
+        WriteU32BE(ihdr + 4, h);
+        ihdr[8] = enc.palette ? enc.palette->bitDepth : 8;
+        ihdr[9] = enc.palette ? 3 : 6;      // Indexed or RGBA
+        ihdr[10] = 0;
+        ihdr[11] = 0;
+        ihdr[12] = 0;
+
+        WritePngChunkHeader(file, "IHDR", sizeof(ihdr), &crc);
+        WritePngChunkData(file, ihdr, sizeof(ihdr), &crc);
+        WritePngChunkEnd(file, crc);
+
+        if(enc.palette) {
+            unsigned char plte[256 * 3];
+            unsigned char trns[256];
+
+            for(int i = 0; i < enc.palette->numColors; ++i) {
+                plte[i * 3] = enc.palette->colors[i].r;
+                plte[i * 3 + 1] = enc.palette->colors[i].g;
+                plte[i * 3 + 2] = enc.palette->colors[i].b;
+                trns[i] = enc.palette->colors[i].a;
+            }
+
+            WritePngChunkHeader(file, "PLTE", enc.palette->numColors * 3, &crc);
+            WritePngChunkData(file, plte, enc.palette->numColors * 3, &crc);
+            WritePngChunkEnd(file, crc);
+
+            if(enc.palette->numTranslucent > 0) {
+                WritePngChunkHeader(file, "tRNS", enc.palette->numTranslucent, &crc);
+                WritePngChunkData(file, trns, enc.palette->numTranslucent, &crc);
+                WritePngChunkEnd(file, crc);
+            }
+        }
+
+        unsigned int adler = 1;
+
+        for(enc.firstBand = 0; enc.firstBand < enc.numBands; enc.firstBand += enc.batchBands) {
+            enc.batchBands = enc.numBands - enc.firstBand < maxBatchBands ? enc.numBands - enc.firstBand : maxBatchBands;
+
+            ParallelFor(enc.batchBands, PngFilterBand, &enc);
+            ParallelFor(enc.batchBands, PngDeflateBand, &enc);
+
+            bool first = enc.firstBand == 0;
+            size_t idatLen = first ? 2 : 0;
+
+            for(int i = 0; i < enc.batchBands; ++i) {
+                idatLen += enc.pieces[i].len;
+            }
+
+            WritePngChunkHeader(file, "IDAT", (unsigned int)idatLen, &crc);
+
+            if(first) {
+                static const unsigned char zlibHeader[2] = { 0x78, 0x01 };
+                WritePngChunkData(file, zlibHeader, 2, &crc);
+            }
+
+            for(int i = 0; i < enc.batchBands; ++i) {
+                int band = enc.firstBand + i;
+                size_t len = (size_t)(PngBandEnd(&enc, band) - band * enc.bandRows) * enc.filteredRowBytes;
+
+                WritePngChunkData(file, enc.pieces[i].data, enc.pieces[i].len, &crc);
+                adler = Adler32Combine(adler, enc.adlers[i], len);
+            }
+
+            WritePngChunkEnd(file, crc);
+
+            // Keep the tail of this batch around as the dictionary for the next one
+            size_t windowLen = enc.dictLen + (size_t)(PngBandEnd(&enc, enc.firstBand + enc.batchBands - 1) - enc.firstBand * enc.bandRows) * enc.filteredRowBytes;
+            size_t keep = windowLen < DEFLATE_WINDOW_SIZE ? windowLen : DEFLATE_WINDOW_SIZE;
+
+            memmove(enc.window, enc.window + windowLen - keep, keep);
+            enc.dictLen = keep;
+        }
+
+        unsigned char adlerBytes[4];
+        WriteU32BE(adlerBytes, adler);
+
+        WritePngChunkHeader(file, "IDAT", 4, &crc);
+        WritePngChunkData(file, adlerBytes, 4, &crc);
+        WritePngChunkEnd(file, crc);
+
+        WritePngChunkHeader(file, "IEND", 0, &crc);
+        WritePngChunkEnd(file, crc);
+
+        ok = !ferror(file);
+        ok = (fclose(file) == 0) && ok;
+    } else {
+        ok = false;
+    }
+
+    for(int i = 0; enc.pieces && i < maxBatchBands; ++i) {
+        free(enc.pieces[i].data);
+    }
+
+    for(int t = 0; t < NumThreads; ++t) {
+        free(enc.scratch[t]);
+        free(enc.rowScratch[t]);
+        free(enc.indexRow[t]);
+    }
+
+    free(palette);
+    free(enc.window);
+    free(enc.pieces);
+    free(enc.adlers);
+
+    return ok;
+}
+
+// Mip chain generation. Every level is a 2x2 box filter of the previous one, weighted by alpha so
+// transparent texels don't darken the edges of frames. Most 2x2 quads are either fully opaque or
+// fully transparent, and for those (equal alpha) the weighted average is the plain average, which
+// is done 2 output texels at a time with SSE2.
+typedef struct
+{
+    unsigned char* data;
+    int w, h;
+} MipLevel;
+
+typedef struct
+{
+    const MipLevel* src;
+    MipLevel* dst;
+} MipJob;
+
+static void DownsampleQuad(unsigned char* out, const unsigned char* a, const unsigned char* b,
+                           const unsigned char* c, const unsigned char* d)
+{
+    int alpha = a[3] + b[3] + c[3] + d[3];
+
+    if(alpha == 0) {
+        memset(out, 0, 4);
+        return;
+    }
+
+    for(int k = 0; k < 3; ++k) {
+        out[k] = (unsigned char)((a[k] * a[3] + b[k] * b[3] + c[k] * c[3] + d[k] * d[3] + alpha / 2) / alpha);
+    }
+
+    out[3] = (unsigned char)((alpha + 2) / 4);
+}
+
+static void DownsampleRow(void* data, int y, int thread)
+{
+    MipJob* job = data;
+    const MipLevel* src = job->src;
+
+    (void)thread;
+
+    int y0 = y * 2;
+    int y1 = y0 + 1 < src->h ? y0 + 1 : src->h - 1;
+
+    const unsigned char* row0 = src->data + (size_t)y0 * src->w * 4;
+    const unsigned char* row1 = src->data + (size_t)y1 * src->w * 4;
+    unsigned char* out = job->dst->data + (size_t)y * job->dst->w * 4;
+
+    int x = 0;
+
+#ifdef USE_SSE2
+    const __m128i alphaMask = _mm_set1_epi32((int)0xff000000);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i two = _mm_set1_epi16(2);
+
+    for(; (x + 1) * 2 + 1 < src->w; x += 2) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(row0 + x * 8));
+        __m128i b = _mm_loadu_si128((const __m128i*)(row1 + x * 8));
+
+        __m128i alphaA = _mm_and_si128(a, alphaMask);
+        __m128i alphaB = _mm_and_si128(b, alphaMask);
+        __m128i first = _mm_shuffle_epi32(alphaA, 0);
+
+        __m128i same = _mm_and_si128(_mm_cmpeq_epi32(alphaA, first), _mm_cmpeq_epi32(alphaB, first));
+
+        if(_mm_movemask_epi8(same) != 0xffff) {
+            DownsampleQuad(out + x * 4, row0 + x * 8, row0 + x * 8 + 4, row1 + x * 8, row1 + x * 8 + 4);
+            DownsampleQuad(out + x * 4 + 4, row0 + x * 8 + 8, row0 + x * 8 + 12, row1 + x * 8 + 8, row1 + x * 8 + 12);
+            continue;
+        }
+
+        if(row0[x * 8 + 3] == 0) {
+            _mm_storel_epi64((__m128i*)(out + x * 4), zero);
+            continue;
+        }
+
+        // Vertical sums of texels 0, 1 (lo) and 2, 3 (hi), then add each pair horizontally
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero));
+
+        lo = _mm_add_epi16(lo, _mm_shuffle_epi32(lo, _MM_SHUFFLE(1, 0, 3, 2)));
+        hi = _mm_add_epi16(hi, _mm_shuffle_epi32(hi, _MM_SHUFFLE(1, 0, 3, 2)));
+
+        __m128i sum = _mm_unpacklo_epi64(lo, hi);
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, two), 2);
+
+        _mm_storel_epi64((__m128i*)(out + x * 4), _mm_packus_epi16(sum, zero));
+    }
+#endif
+
+    for(; x < job->dst->w; ++x) {
+        int x0 = x * 2;
+        int x1 = x0 + 1 < src->w ? x0 + 1 : src->w - 1;
+
+        DownsampleQuad(out + x * 4, row0 + x0 * 4, row0 + x1 * 4, row1 + x0 * 4, row1 + x1 * 4);
+    }
+}
+
+// Builds the full chain down to 1x1. Level 0 refers to the atlas itself and isn't owned by the chain.
+static MipLevel* GenerateMips(unsigned char* src, int w, int h, int* numLevels)
+{
+    int count = 1;
+
+    while((w >> count) > 0 || (h >> count) > 0) {
+        ++count;
+    }
+
+    MipLevel* levels = calloc(count, sizeof(MipLevel));
+
+    if(!levels) {
+        return NULL;
+    }
+
+    levels[0].data = src;
+    levels[0].w = w;
+    levels[0].h = h;
+
+    for(int i = 1; i < count; ++i) {
+        MipLevel* level = &levels[i];
+
+        level->w = levels[i - 1].w > 1 ? levels[i - 1].w / 2 : 1;
+        level->h = levels[i - 1].h > 1 ? levels[i - 1].h / 2 : 1;
+        level->data = malloc((size_t)level->w * level->h * 4);
+
+        if(!level->data) {
+            for(int j = 1; j < i; ++j) {
+                free(levels[j].data);
+            }
+
+            free(levels);
+            return NULL;
+        }
+
+        MipJob job = { &levels[i - 1], level };
+        ParallelFor(level->h, DownsampleRow, &job);
+    }
+
+    *numLevels = count;
+    return levels;
+}
+
+static void FreeMips(MipLevel* levels, int numLevels)
+{
+    for(int i = 1; i < numLevels; ++i) {
+        free(levels[i].data);
+    }
+
+    free(levels);
+}
+
+// BC1 (DXT1) and BC3 (DXT5) block compression. Endpoints come from the (slightly inset) bounding
+// box of the block's colors and every pixel is projected onto the line between them, which is
+// the classic real-time DXT approach. Blocks are independent so rows of blocks are encoded in parallel.
+static unsigned short PackRgb565(int r, int g, int b)
+{
+    return (unsigned short)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+static void UnpackRgb565(unsigned short c, int* rgb)
+{
+    int r = (c >> 11) & 31;
+    int g = (c >> 5) & 63;
+    int b = c & 31;
+
+    rgb[0] = (r << 3) | (r >> 2);
+    rgb[1] = (g << 2) | (g >> 4);
+    rgb[2] = (b << 3) | (b >> 2);
+}
+
+// Copies a 4x4 block out of the image, clamping at the right and bottom edges
+static void FetchBlock(Pixel block[16], const unsigned char* src, int w, int h, int stride, int bx, int by)
+{
+    for(int y = 0; y < 4; ++y) {
+        int sy = by * 4 + y < h ? by * 4 + y : h - 1;
+        const Pixel* row = (const Pixel*)(src + (size_t)sy * stride);
+
+        for(int x = 0; x < 4; ++x) {
+            int sx = bx * 4 + x < w ? bx * 4 + x : w - 1;
+            block[y * 4 + x] = row[sx];
+        }
+    }
+}
+
+static void BlockBounds(const Pixel block[16], Pixel* minColor, Pixel* maxColor)
+{
+#ifdef USE_SSE2
+    __m128i p0 = _mm_loadu_si128((const __m128i*)block);
+    __m128i p1 = _mm_loadu_si128((const __m128i*)block + 1);
+    __m128i p2 = _mm_loadu_si128((const __m128i*)block + 2);
+    __m128i p3 = _mm_loadu_si128((const __m128i*)block + 3);
+
+    __m128i mn = _mm_min_epu8(_mm_min_epu8(p0, p1), _mm_min_epu8(p2, p3));
+    __m128i mx = _mm_max_epu8(_mm_max_epu8(p0, p1), _mm_max_epu8(p2, p3));
+
+    // Fold the 4 pixels in each register down to one
+    mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(1, 0, 3, 2)));
+    mn = _mm_min_epu8(mn, _mm_shuffle_epi32(mn, _MM_SHUFFLE(2, 3, 0, 1)));
+    mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(1, 0, 3, 2)));
+    mx = _mm_max_epu8(mx, _mm_shuffle_epi32(mx, _MM_SHUFFLE(2, 3, 0, 1)));
+
+    int mnBits = _mm_cvtsi128_si32(mn);
+    int mxBits = _mm_cvtsi128_si32(mx);
+
+    memcpy(minColor, &mnBits, 4);
+    memcpy(maxColor, &mxBits, 4);
+#else
+    *minColor = block[0];
+    *maxColor = block[0];
+
+    for(int i = 1; i < 16; ++i) {
+        const Pixel* p = &block[i];
+
+        if(p->r < minColor->r) minColor->r = p->r;
+        if(p->g < minColor->g) minColor->g = p->g;
+        if(p->b < minColor->b) minColor->b = p->b;
+        if(p->a < minColor->a) minColor->a = p->a;
+        if(p->r > maxColor->r) maxColor->r = p->r;
+        if(p->g > maxColor->g) maxColor->g = p->g;
+        if(p->b > maxColor->b) maxColor->b = p->b;
+        if(p->a > maxColor->a) maxColor->a = p->a;
+    }
+#endif
+}
+
+// dots[i] = (block[i] - base) . axis over the rgb channels
+static void BlockDots(const Pixel block[16], const int* base, const int* axis, int dots[16])
+{
+#ifdef USE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i baseV = _mm_setr_epi16(base[0], base[1], base[2], 0, base[0], base[1], base[2], 0);
+    __m128i axisV = _mm_setr_epi16(axis[0], axis[1], axis[2], 0, axis[0], axis[1], axis[2], 0);
+
+    for(int i = 0; i < 16; i += 4) {
+        __m128i p = _mm_loadu_si128((const __m128i*)(block + i));
+
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(p, zero), baseV);
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(p, zero), baseV);
+
+        // Each madd gives [r*ar + g*ag, b*ab] for two pixels, which are then added pairwise
+        __m128 m0 = _mm_castsi128_ps(_mm_madd_epi16(lo, axisV));
+        __m128 m1 = _mm_castsi128_ps(_mm_madd_epi16(hi, axisV));
+
+        __m128i even = _mm_castps_si128(_mm_shuffle_ps(m0, m1, _MM_SHUFFLE(2, 0, 2, 0)));
+        __m128i odd = _mm_castps_si128(_mm_shuffle_ps(m0, m1, _MM_SHUFFLE(3, 1, 3, 1)));
+
+        _mm_storeu_si128((__m128i*)(dots + i), _mm_add_epi32(even, odd));
+    }
+#else
+    for(int i = 0; i < 16; ++i) {
+        dots[i] = (block[i].r - base[0]) * axis[0] + (block[i].g - base[1]) * axis[1] + (block[i].b - base[2]) * axis[2];
+    }
+#endif
+}
+
+// Writes the 8 byte color part of a BC1/BC3 block. Fully transparent pixels don't contribute to
+// the endpoints. For BC1, pixels with alpha < 128 make the block use the 3 color mode where
+// index 3 is transparent.
+static void EncodeColorBlock(unsigned char* out, const Pixel block[16], bool bc1)
+{
+    bool transparent[16];
+    bool anyTransparent = false;
+
+    Pixel opaque[16];
+    int numOpaque = 0;
+
+    for(int i = 0; i < 16; ++i) {
+        transparent[i] = bc1 ? block[i].a < 128 : block[i].a == 0;
+
+        if(transparent[i]) {
+            anyTransparent = true;
+        } else {
+            opaque[numOpaque++] = block[i];
+        }
+    }
+
+    if(numOpaque == 0) {
+        memset(out, 0, 4);
+        memset(out + 4, bc1 ? 0xff : 0, 4);
+        return;
+    }
+
+    // BC3 colors are always in the 4 color mode
+    if(!bc1) {
+        anyTransparent = false;
+    }
+
+    // Pad with copies so the bounds can always look at 16 pixels
+    for(int i = numOpaque; i < 16; ++i) {
+        opaque[i] = opaque[0];
+    }
+
+    Pixel mn, mx;
+    BlockBounds(opaque, &mn, &mx);
+
+    // Inset the box a little, which lowers the average error compared to the extremes
+    int insetR = (mx.r - mn.r) >> 4;
+    int insetG = (mx.g - mn.g) >> 4;
+    int insetB = (mx.b - mn.b) >> 4;
+
+    unsigned short c0 = PackRgb565(mx.r - insetR, mx.g - insetG, mx.b - insetB);
+    unsigned short c1 = PackRgb565(mn.r + insetR, mn.g + insetG, mn.b + insetB);
+
+    unsigned int indices = 0;
+
+    if(anyTransparent) {
+        // 3 color mode requires c0 <= c1
+        if(c0 > c1) {
+            unsigned short t = c0;
+            c0 = c1;
+            c1 = t;
+        }
+    } else if(c0 < c1) {
+        unsigned short t = c0;
+        c0 = c1;
+        c1 = t;
+    }
+
+    if(c0 != c1) {
+        int e0[3], e1[3];
+
+        UnpackRgb565(c0, e0);
+        UnpackRgb565(c1, e1);
+
+        int axis[3] = { e1[0] - e0[0], e1[1] - e0[1], e1[2] - e0[2] };
+        int len = axis[0] * axis[0] + axis[1] * axis[1] + axis[2] * axis[2];
+
+        int dots[16];
+        BlockDots(block, e0, axis, dots);
+
+        // Position along the line from c0 to c1 in steps, mapped to the BC1 index order
+        static const unsigned int fourColor[4] = { 0, 2, 3, 1 };
+        static const unsigned int threeColor[3] = { 0, 2, 1 };
+
+        int steps = anyTransparent ? 2 : 3;
+
+        for(int i = 0; i < 16; ++i) {
+            unsigned int index;
+
+            if(transparent[i] && anyTransparent) {
+                index = 3;
+            } else {
+                int t = (dots[i] * steps * 2 + len) / (len * 2);
+
+                if(dots[i] < 0) t = 0;
+                if(t > steps) t = steps;
+
+                index = anyTransparent ? threeColor[t] : fourColor[t];
+            }
+
+            indices |= index << (i * 2);
+        }
+    } else {
+        for(int i = 0; i < 16; ++i) {
+            if(transparent[i] && anyTransparent) indices |= 3u << (i * 2);
+        }
+    }
+
+    out[0] = c0 & 0xff;
+    out[1] = c0 >> 8;
+    out[2] = c1 & 0xff;
+    out[3] = c1 >> 8;
+    WriteU32LE(out + 4, indices);
+}
+
+// The 8 byte alpha part of a BC3 block, always in the 8 alpha mode (a0 > a1)
+static void EncodeAlphaBlock(unsigned char* out, const Pixel block[16])
+{
+    int mn = 255;
+    int mx = 0;
+
+    for(int i = 0; i < 16; ++i) {
+        if(block[i].a < mn) mn = block[i].a;
+        if(block[i].a > mx) mx = block[i].a;
+    }
+
+    out[0] = (unsigned char)mx;
+    out[1] = (unsigned char)mn;
+
+    unsigned long long indices = 0;
+
+    if(mx > mn) {
+        int range = mx - mn;
+
+        for(int i = 0; i < 16; ++i) {
+            int t = ((block[i].a - mn) * 14 + range) / (range * 2);
+
+            // t = 7 is a0, t = 0 is a1 and the rest are interpolated from a0 towards a1
+            unsigned long long index = t == 7 ? 0 : t == 0 ? 1 : (unsigned long long)(8 - t);
+            indices |= index << (i * 3);
+        }
+    }
+
+    for(int i = 0; i < 6; ++i) {
+        out[2 + i] = (unsigned char)(indices >> (i * 8));
+    }
+}
+
+typedef void (*BlockFunc)(unsigned char* out, const Pixel block[16]);
+
+typedef struct
+{
+    const unsigned char* src;
+    int w, h, stride;
+
+    BlockFunc func;
+    int blocksX;
+    int blockSize;
+    unsigned char* out;
+} BlockEncoder;
+
+static void EncodeBlockRow(void* data, int by, int thread)
+{
+    BlockEncoder* enc = data;
+
+    (void)thread;
+
+    for(int bx = 0; bx < enc->blocksX; ++bx) {
+        Pixel block[16];
+        FetchBlock(block, enc->src, enc->w, enc->h, enc->stride, bx, by);
+
+        enc->func(enc->out + ((size_t)by * enc->blocksX + bx) * enc->blockSize, block);
+    }
+}
+
+// Compresses the whole image with func, one row of blocks per job
+static unsigned char* EncodeBlocks(const unsigned char* src, int w, int h, int stride, BlockFunc func, int blockSize, size_t* size)
+{
+    BlockEncoder enc;
+
+    enc.src = src;
+    enc.w = w;
+    enc.h = h;
+    enc.stride = stride;
+    enc.func = func;
+    enc.blocksX = (w + 3) / 4;
+    enc.blockSize = blockSize;
+
+    int blocksY = (h + 3) / 4;
+    *size = (size_t)enc.blocksX * blocksY * blockSize;
+
+    enc.out = malloc(*size);
+
+    if(enc.out) {
+        ParallelFor(blocksY, EncodeBlockRow, &enc);
+    }
+
+    return enc.out;
+}
+
+static void EncodeBc1Block(unsigned char* out, const Pixel block[16])
+{
+    EncodeColorBlock(out, block, true);
+}
+
+static void EncodeBc3Block(unsigned char* out, const Pixel block[16])
+{
+    EncodeAlphaBlock(out, block);
+    EncodeColorBlock(out + 8, block, false);
+}
+
+#define DDS_HEADER_SIZE 128
+
+static bool DdsWrite(const char* filename, const MipLevel* levels, int numLevels, OutputFormat format)
+{
+    BlockFunc func = format == OUTPUT_BC3 ? EncodeBc3Block : EncodeBc1Block;
+    int blockSize = format == OUTPUT_BC3 ? 16 : 8;
+
+    unsigned int topSize = (unsigned int)(((levels[0].w + 3) / 4) * ((levels[0].h + 3) / 4) * blockSize);
+
+    unsigned char header[DDS_HEADER_SIZE] = { 0 };
+
+    memcpy(header, "DDS ", 4);
+    WriteU32LE(header + 4, 124);
+    WriteU32LE(header + 8, 0x1 | 0x2 | 0x4 | 0x1000 | 0x80000 | (numLevels > 1 ? 0x20000 : 0));   // Caps, height, width, pixel format, linear size, mip count
+    WriteU32LE(header + 12, levels[0].h);
+    WriteU32LE(header + 16, levels[0].w);
+    WriteU32LE(header + 20, topSize);
+    WriteU32LE(header + 28, numLevels);
+
+    // Pixel format
+    WriteU32LE(header + 76, 32);
+    WriteU32LE(header + 80, 0x4);   // Four CC
+    memcpy(header + 84, format == OUTPUT_BC3 ? "DXT5" : "DXT1", 4);
+
+    WriteU32LE(header + 108, 0x1000 | (numLevels > 1 ? 0x8 | 0x400000 : 0));   // Texture, complex and mipmap
+
+    FILE* file = fopen(filename, "wb");
+
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fwrite(header, 1, DDS_HEADER_SIZE, file) == DDS_HEADER_SIZE;
+
+    for(int i = 0; ok && i < numLevels; ++i) {
+        size_t size;
+        unsigned char* blocks = EncodeBlocks(levels[i].data, levels[i].w, levels[i].h, levels[i].w * 4, func, blockSize, &size);
+
+        ok = blocks && fwrite(blocks, 1, size, file) == size;
+        free(blocks);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+
+    return ok;
+}
+
+// ETC2 RGBA8 (RGB block plus EAC alpha block) compression. Only the ETC1 compatible individual and
+// differential modes are used for the colors. The fast mode derives the base colors from the
+// subblock averages, the quality mode also refines them and always tries both modes.
+static const int EtcModifiers[8][2] = {
+    { 2, 8 }, { 5, 17 }, { 9, 29 }, { 13, 42 }, { 18, 60 }, { 24, 80 }, { 33, 106 }, { 47, 183 }
+};
+
+static const int EacModifiers[16][8] = {
+    { -3, -6, -9, -15, 2, 5, 8, 14 },
+    { -3, -7, -10, -13, 2, 6, 9, 12 },
+    { -2, -5, -8, -13, 1, 4, 7, 12 },
+    { -2, -4, -6, -13, 1, 3, 5, 12 },
+    { -3, -6, -8, -12, 2, 5, 7, 11 },
+    { -3, -7, -9, -11, 2, 6, 8, 10 },
+    { -4, -7, -8, -11, 3, 6, 7, 10 },
+    { -3, -5, -8, -11, 2, 4, 7, 10 },
+    { -2, -6, -8, -10, 1, 5, 7, 9 },
+    { -2, -5, -8, -10, 1, 4, 7, 9 },
+    { -2, -4, -8, -10, 1, 3, 7, 9 },
+    { -2, -5, -7, -10, 1, 4, 6, 9 },
+    { -3, -4, -7, -10, 2, 3, 6, 9 },
+    { -1, -2, -3, -10, 0, 1, 2, 9 },
+    { -4, -6, -8, -9, 3, 5, 7, 8 },
+    { -3, -5, -7, -9, 2, 4, 6, 8 }
+};
+
+// Pixels (as y * 4 + x) of the two subblocks for flip = 0 (2x4 side by side) and flip = 1 (4x2 stacked)
+static const unsigned char EtcSubblocks[2][2][8] = {
+    { { 0, 4, 8, 12, 1, 5, 9, 13 }, { 2, 6, 10, 14, 3, 7, 11, 15 } },
+    { { 0, 1, 2, 3, 4, 5, 6, 7 }, { 8, 9, 10, 11, 12, 13, 14, 15 } }
+};
+
+static int Clamp255(int v)
+{
+    return v < 0 ? 0 : v > 255 ? 255 : v;
+}
+
+typedef struct
+{
+    int error;
+    int table;
+    unsigned char indices[16];
+} EtcSubblockFit;
+
+// Finds the best modifier table (and per pixel modifiers) for the given pixels and base color.
+// Tables that can't beat limit are abandoned early, in which case the error is left at limit.
+static void FitEtcSubblock(EtcSubblockFit* fit, const Pixel block[16], const unsigned char* pixels, int count, const int* base, int limit)
+{
+    fit->error = limit;
+    fit->table = 0;
+    memset(fit->indices, 0, sizeof(fit->indices));
+
+    for(int t = 0; t < 8; ++t) {
+        // Modifier index order is +small, +large, -small, -large
+        const int mods[4] = { EtcModifiers[t][0], EtcModifiers[t][1], -EtcModifiers[t][0], -EtcModifiers[t][1] };
+
+        int colors[4][3];
+
+        for(int m = 0; m < 4; ++m) {
+            for(int k = 0; k < 3; ++k) {
+                colors[m][k] = Clamp255(base[k] + mods[m]);
+            }
+        }
+
+        int error = 0;
+        unsigned char indices[16];
+
+        for(int i = 0; i < count && error < fit->error; ++i) {
+            const Pixel* p = &block[pixels[i]];
+            int best = INT_MAX;
+
+            for(int m = 0; m < 4; ++m) {
+                int dr = colors[m][0] - p->r;
+                int dg = colors[m][1] - p->g;
+                int db = colors[m][2] - p->b;
+                int e = dr * dr + dg * dg + db * db;
+
+                if(e < best) {
+                    best = e;
+                    indices[pixels[i]] = (unsigned char)m;
+                }
+            }
+
+            error += best;
+        }
+
+        if(error < fit->error) {
+            fit->error = error;
+            fit->table = t;
+
+            for(int i = 0; i < count; ++i) {
+                fit->indices[pixels[i]] = indices[pixels[i]];
+            }
+        }
+    }
+}
+
+static int Expand4(int c)
+{
+    return (c << 4) | c;
+}
+
+static int Expand5(int c)
+{
+    return (c << 3) | (c >> 2);
+}
+
+// Quantized color and its fit for one subblock
+typedef struct
+{
+    int q[3];
+    EtcSubblockFit fit;
+} EtcCandidate;
+
+// Fits the quantized color c (bits is 4 or 5) and keeps it if it beats best
+static void TryEtcColor(EtcCandidate* best, const Pixel block[16], const unsigned char* pixels, int count, const int* c, int bits)
+{
+    int maxQ = (1 << bits) - 1;
+
+    if(c[0] < 0 || c[1] < 0 || c[2] < 0 || c[0] > maxQ || c[1] > maxQ || c[2] > maxQ) {
+        return;
+    }
+
+    int base[3];
+
+    for(int k = 0; k < 3; ++k) {
+        base[k] = bits == 4 ? Expand4(c[k]) : Expand5(c[k]);
+    }
+
+    EtcSubblockFit fit;
+    FitEtcSubblock(&fit, block, pixels, count, base, best->fit.error);
+
+    if(fit.error < best->fit.error) {
+        best->fit = fit;
+        memcpy(best->q, c, sizeof(best->q));
+    }
+}
+
+// Finds a base color for the subblock starting from q. The thorough search also tries the
+// neighbouring colors and then moves the base to the mean of the pixels minus their modifiers.
+static void SearchEtcColor(EtcCandidate* best, const Pixel block[16], const unsigned char* pixels, int count,
+                           const int* q, int bits, bool thorough)
+{
+    // Steps along each channel and along the gray axis
+    static const int steps[8][3] = {
+        { -1, 0, 0 }, { 1, 0, 0 }, { 0, -1, 0 }, { 0, 1, 0 }, { 0, 0, -1 }, { 0, 0, 1 }, { -1, -1, -1 }, { 1, 1, 1 }
+    };
+
+    best->fit.error = INT_MAX;
+
+    TryEtcColor(best, block, pixels, count, q, bits);
+
+    if(!thorough || count == 0) {
+        return;
+    }
+
+    for(int i = 0; i < 8; ++i) {
+        int c[3] = { q[0] + steps[i][0], q[1] + steps[i][1], q[2] + steps[i][2] };
+        TryEtcColor(best, block, pixels, count, c, bits);
+    }
+
+    int maxQ = (1 << bits) - 1;
+
+    for(int iter = 0; iter < 2; ++iter) {
+        const int* mods = EtcModifiers[best->fit.table];
+        int sum[3] = { 0, 0, 0 };
+
+        for(int i = 0; i < count; ++i) {
+            const Pixel* p = &block[pixels[i]];
+            int index = best->fit.indices[pixels[i]];
+            int mod = index & 2 ? -mods[index & 1] : mods[index & 1];
+
+            sum[0] += p->r - mod;
+            sum[1] += p->g - mod;
+            sum[2] += p->b - mod;
+        }
+
+        int c[3];
+
+        for(int k = 0; k < 3; ++k) {
+            int mean = (sum[k] + count / 2) / count;
+            c[k] = (Clamp255(mean) * maxQ + 127) / 255;
+        }
+
+        if(memcmp(c, best->q, sizeof(c)) == 0) break;
+
+        TryEtcColor(best, block, pixels, count, c, bits);
+    }
+}
+
+static void EncodeEtc2ColorBlock(unsigned char* out, const Pixel block[16], bool quality)
+{
+    int bestError = INT_MAX;
+    unsigned int bestHi = 0;
+    unsigned int bestLo = 0;
+
+    for(int flip = 0; flip < 2; ++flip) {
+        // Fully transparent pixels don't constrain the colors
+        unsigned char pixels[2][8];
+        int counts[2];
+        int avg[2][3];
+
+        for(int s = 0; s < 2; ++s) {
+            int sum[3] = { 0, 0, 0 };
+
+            counts[s] = 0;
+
+            for(int i = 0; i < 8; ++i) {
+                int index = EtcSubblocks[flip][s][i];
+                const Pixel* p = &block[index];
+
+                if(p->a == 0) continue;
+
+                pixels[s][counts[s]++] = (unsigned char)index;
+                sum[0] += p->r;
+                sum[1] += p->g;
+                sum[2] += p->b;
+            }
+
+            for(int k = 0; k < 3; ++k) {
+                avg[s][k] = counts[s] ? (sum[k] + counts[s] / 2) / counts[s] : 0;
+            }
+        }
+
+        for(int diff = 1; diff >= 0; --diff) {
+            int bits = diff ? 5 : 4;
+            int maxQ = (1 << bits) - 1;
+
+            EtcCandidate cand[2];
+
+            for(int s = 0; s < 2; ++s) {
+                int q[3];
+
+                for(int k = 0; k < 3; ++k) {
+                    q[k] = (avg[s][k] * maxQ + 127) / 255;
+                }
+
+                SearchEtcColor(&cand[s], block, pixels[s], counts[s], q, bits, quality);
+            }
+
+            if(diff) {
+                bool valid = true;
+
+                for(int k = 0; k < 3; ++k) {
+                    int d = cand[1].q[k] - cand[0].q[k];
+                    valid = valid && d >= -4 && d <= 3;
+                }
+
+                if(!valid) {
+                    if(!quality) continue;
+
+                    // Pull the second color to the closest one the 3 bit deltas can reach
+                    int q[3];
+
+                    for(int k = 0; k < 3; ++k) {
+                        int d = cand[1].q[k] - cand[0].q[k];
+                        q[k] = cand[0].q[k] + (d < -4 ? -4 : d > 3 ? 3 : d);
+                    }
+
+                    SearchEtcColor(&cand[1], block, pixels[1], counts[1], q, bits, false);
+                }
+            }
+
+            int error = cand[0].fit.error + cand[1].fit.error;
+
+            if(error >= bestError) {
+                // The fast mode only falls back to individual colors when differential isn't possible
+                if(!quality) break;
+                continue;
+            }
+
+            unsigned int hi;
+
+            if(diff) {
+                hi = (unsigned int)cand[0].q[0] << 27 | (unsigned int)((cand[1].q[0] - cand[0].q[0]) & 7) << 24 |
+                     (unsigned int)cand[0].q[1] << 19 | (unsigned int)((cand[1].q[1] - cand[0].q[1]) & 7) << 16 |
+                     (unsigned int)cand[0].q[2] << 11 | (unsigned int)((cand[1].q[2] - cand[0].q[2]) & 7) << 8 |
+                     1u << 1;
+            } else {
+                hi = (unsigned int)cand[0].q[0] << 28 | (unsigned int)cand[1].q[0] << 24 |
+                     (unsigned int)cand[0].q[1] << 20 | (unsigned int)cand[1].q[1] << 16 |
+                     (unsigned int)cand[0].q[2] << 12 | (unsigned int)cand[1].q[2] << 8;
+            }
+
+            hi |= (unsigned int)cand[0].fit.table << 5 | (unsigned int)cand[1].fit.table << 2 | (unsigned int)flip;
+
+            // Indices are stored column major, most significant bits in the upper half
+            unsigned int lo = 0;
+
+            for(int s = 0; s < 2; ++s) {
+                for(int i = 0; i < 8; ++i) {
+                    int p = EtcSubblocks[flip][s][i];
+                    int bit = (p % 4) * 4 + p / 4;
+                    unsigned int index = cand[s].fit.indices[p];
+
+                    lo |= (index >> 1) << (16 + bit);
+                    lo |= (index & 1) << bit;
+                }
+            }
+
+            bestError = error;
+            bestHi = hi;
+            bestLo = lo;
+
+            if(!quality) break;
+        }
+    }
+
+    WriteU32BE(out, bestHi);
+    WriteU32BE(out + 4, bestLo);
+}
+
+static int FitEacAlpha(const Pixel block[16], int base, int mul, int table, unsigned char* indices, int limit)
+{
+    int error = 0;
+
+    for(int i = 0; i < 16 && error < limit; ++i) {
+        int best = INT_MAX;
+
+        for(int m = 0; m < 8; ++m) {
+            int d = Clamp255(base + EacModifiers[table][m] * mul) - block[i].a;
+
+            if(d * d < best) {
+                best = d * d;
+                indices[i] = (unsigned char)m;
+            }
+        }
+
+        error += best;
+    }
+
+    return error;
+}
+
+static void EncodeEacAlphaBlock(unsigned char* out, const Pixel block[16], bool quality)
+{
+    int mn = 255;
+    int mx = 0;
+
+    for(int i = 0; i < 16; ++i) {
+        if(block[i].a < mn) mn = block[i].a;
+        if(block[i].a > mx) mx = block[i].a;
+    }
+
+    int bestError = INT_MAX;
+    int bestBase = mn;
+    int bestMul = 1;
+    int bestTable = 13;
+    unsigned char bestIndices[16];
+
+    if(mn == mx) {
+        // Table 13 has a zero modifier, which reproduces a constant block exactly
+        memset(bestIndices, 4, sizeof(bestIndices));
+    } else {
+        for(int t = 0; t < 16; ++t) {
+            int lo = EacModifiers[t][3];
+            int hi = EacModifiers[t][7];
+
+            int mul = ((mx - mn) + (hi - lo) / 2) / (hi - lo);
+
+            // Ranges narrower than half the table's span round to 0, but the multiplier starts at 1
+            if(mul < 1) mul = 1;
+            if(mul > 15) mul = 15;
+
+            int base = (mn + mx + 1) / 2 - (lo + hi) * mul / 2;
+
+            int mulRadius = quality ? 1 : 0;
+            int baseRadius = quality ? 2 : 0;
+
+            for(int m = mul - mulRadius; m <= mul + mulRadius; ++m) {
+                if(m < 1 || m > 15) continue;
+
+                for(int b = base - baseRadius; b <= base + baseRadius; ++b) {
+                    if(b < 0 || b > 255) continue;
+
+                    unsigned char indices[16];
+                    int error = FitEacAlpha(block, b, m, t, indices, bestError);
+
+                    if(error < bestError) {
+                        bestError = error;
+                        bestBase = b;
+                        bestMul = m;
+                        bestTable = t;
+                        memcpy(bestIndices, indices, sizeof(indices));
+                    }
+                }
+            }
+        }
+    }
+
+    out[0] = (unsigned char)bestBase;
+    out[1] = (unsigned char)(bestMul << 4 | bestTable);
+
+    // 3 bit indices in column major order, first pixel in the most significant bits
+    unsigned long long bits = 0;
+
+    for(int x = 0; x < 4; ++x) {
+        for(int y = 0; y < 4; ++y) {
+            bits = (bits << 3) | bestIndices[y * 4 + x];
+        }
+    }
+
+    for(int i = 0; i < 6; ++i) {
+        out[2 + i] = (unsigned char)(bits >> (40 - i * 8));
+    }
+}
+
+static void EncodeEtc2FastBlock(unsigned char* out, const Pixel block[16])
+{
+    EncodeEacAlphaBlock(out, block, false);
+    EncodeEtc2ColorBlock(out + 8, block, false);
+}
+
+static void EncodeEtc2QualityBlock(unsigned char* out, const Pixel block[16])
+{
+    EncodeEacAlphaBlock(out, block, true);
+    EncodeEtc2ColorBlock(out + 8, block, true);
+}
+
+#define GL_COMPRESSED_RGBA8_ETC2_EAC 0x9278
+#define GL_RGBA 0x1908
+
+static bool KtxWrite(const char* filename, const MipLevel* levels, int numLevels, bool quality)
+{
+    static const unsigned char identifier[12] = { 0xab, 0x4b, 0x54, 0x58, 0x20, 0x31, 0x31, 0xbb, 0x0d, 0x0a, 0x1a, 0x0a };
+
+    unsigned char header[64];
+
+    memcpy(header, identifier, 12);
+    WriteU32LE(header + 12, 0x04030201);
+    WriteU32LE(header + 16, 0);     // glType
+    WriteU32LE(header + 20, 1);     // glTypeSize
+    WriteU32LE(header + 24, 0);     // glFormat
+    WriteU32LE(header + 28, GL_COMPRESSED_RGBA8_ETC2_EAC);
+    WriteU32LE(header + 32, GL_RGBA);
+    WriteU32LE(header + 36, levels[0].w);
+    WriteU32LE(header + 40, levels[0].h);
+    WriteU32LE(header + 44, 0);     // Depth
+    WriteU32LE(header + 48, 0);     // Array elements
+    WriteU32LE(header + 52, 1);     // Faces
+    WriteU32LE(header + 56, numLevels);
+    WriteU32LE(header + 60, 0);     // Key/value data
+
+    FILE* file = fopen(filename, "wb");
+
+    if(!file) {
+        return false;
+    }
+
+    bool ok = fwrite(header, 1, sizeof(header), file) == sizeof(header);
+
+    // Each level is its size followed by the blocks, which are always a multiple of 4 bytes so there's no padding
+    for(int i = 0; ok && i < numLevels; ++i) {
+        size_t size;
+        unsigned char* blocks = EncodeBlocks(levels[i].data, levels[i].w, levels[i].h, levels[i].w * 4,
+                                             quality ? EncodeEtc2QualityBlock : EncodeEtc2FastBlock, 16, &size);
+
+        unsigned char imageSize[4];
+        WriteU32LE(imageSize, (unsigned int)size);
+
+        ok = blocks && fwrite(imageSize, 1, 4, file) == 4 && fwrite(blocks, 1, size, file) == size;
+        free(blocks);
+    }
+
+    ok = (fclose(file) == 0) && ok;
+
+    return ok;
+}
+
+// Copies src into path with its extension swapped for ext
+static bool ReplaceExtension(char* path, size_t size, const char* src, const char* ext)
+{
+    const char* dot = strrchr(src, '.');
+
+    if(!dot) {
+        fprintf(stderr, "Failed; missing extension on output image path.\n");
+        return false;
+    }
+
+    size_t stem = (size_t)(dot - src) + 1;
+
+    if(stem + strlen(ext) >= size) {
+        fprintf(stderr, "Failed; output image path is too long.\n");
+        return false;
+    }
+
+    memcpy(path, src, stem);
+    strcpy(path + stem, ext);
+
+    return true;
+}
+
+// Copies src into path with suffix inserted in front of its extension
+static bool AddSuffix(char* path, size_t size, const char* src, const char* suffix)
+{
+    const char* dot = strrchr(src, '.');
+
+    if(!dot) {
+        fprintf(stderr, "Failed; missing extension on output image path.\n");
+        return false;
+    }
+
+    size_t stem = (size_t)(dot - src);
+
+    if(strlen(src) + strlen(suffix) >= size) {
+        fprintf(stderr, "Failed; output image path is too long.\n");
+        return false;
+    }
+
+    memcpy(path, src, stem);
+    strcpy(path + stem, suffix);
+    strcat(path, dot);
+
+    return true;
+}
+
+// Loads any image stb_image understands plus QOI, always as 4 components
+static unsigned char* LoadImage(const char* filename, int* w, int* h, const char** reason)
+{
+    size_t size;
+    unsigned char* data = ReadEntireFile(filename, &size);
+
+    if(!data) {
+        *reason = "can't open file";
+        return NULL;
+    }
+
+    unsigned char* pixels;
+
+    if(IsQoi(data, size)) {
+        pixels = QoiDecode(data, size, w, h);
+        *reason = "corrupt QOI image";
+    } else {
+        int n;
+        pixels = stbi_load_from_memory(data, (int)size, w, h, &n, 4);
+        *reason = stbi_failure_reason();
+    }
+
+    free(data);
+    return pixels;
+}
+
+static int NumFrames = 0;
+static Rect Frames[MAX_FRAMES];
+
+// Stable LSD radix sort of the indices by keys[index], a byte at a time and only for as many bytes as
+// the largest key has. Short runs are insertion sorted instead, which is cheaper than the counting.
+static void RadixSortIndices(int* indices, int* scratch, const unsigned int* keys, int count)
+{
+    if(count < 32) {
+        for(int i = 1; i < count; ++i) {
+            int index = indices[i];
+            int j = i;
+
+            for(; j > 0 && keys[indices[j - 1]] > keys[index]; --j) {
+                indices[j] = indices[j - 1];
+            }
+
+            indices[j] = index;
+        }
+
+        return;
+    }
+
+    unsigned int maxKey = 0;
+
+    for(int i = 0; i < count; ++i) {
+        if(keys[indices[i]] > maxKey) maxKey = keys[indices[i]];
+    }
+
+    for(int shift = 0; shift < 32 && (maxKey >> shift) > 0; shift += 8) {
+        int offsets[257] = { 0 };
+
+        for(int i = 0; i < count; ++i) {
+            offsets[((keys[indices[i]] >> shift) & 0xff) + 1] += 1;
+        }
+
+        for(int b = 0; b < 256; ++b) {
+            offsets[b + 1] += offsets[b];
+        }
+
+        for(int i = 0; i < count; ++i) {
+            scratch[offsets[(keys[indices[i]] >> shift) & 0xff]++] = indices[i];
+        }
+
+        memcpy(indices, scratch, sizeof(int) * count);
+    }
+}
+
+// Puts the frames in reading order. They're sorted by y and swept into rows, where a row takes every
+// frame starting less than FrameRowThresh below its first frame, and then every row is sorted by x.
+// Unlike comparing frames pairwise with the threshold, this is a proper order, so equal input always
+// gives the same result.
+static bool OrderFrames(void)
+{
+    int* order = malloc(sizeof(int) * NumFrames);
+    int* scratch = malloc(sizeof(int) * NumFrames);
+    unsigned int* keys = malloc(sizeof(unsigned int) * NumFrames);
+    Rect* sorted = malloc(sizeof(Rect) * NumFrames);
+
+    if(!order || !scratch || !keys || !sorted) {
+        free(order);
+        free(scratch);
+        free(keys);
+        free(sorted);
+        return false;
+    }
+
+    for(int i = 0; i < NumFrames; ++i) {
+        order[i] = i;
+        keys[i] = (unsigned int)Frames[i].y;
+    }
+
+    RadixSortIndices(order, scratch, keys, NumFrames);
+
+    for(int start = 0; start < NumFrames; ) {
+        int top = Frames[order[start]].y;
+        int end = start + 1;
+
+        while(end < NumFrames && Frames[order[end]].y - top < FrameRowThresh) {
+            end += 1;
+        }
+
+        for(int i = start; i < end; ++i) {
+            keys[order[i]] = (unsigned int)Frames[order[i]].x;
+        }
+
+        RadixSortIndices(order + start, scratch, keys, end - start);
+
+        start = end;
+    }
+
+    for(int i = 0; i < NumFrames; ++i) {
+        sorted[i] = Frames[order[i]];
+    }
+
+    memcpy(Frames, sorted, sizeof(Rect) * NumFrames);
+
+    free(order);
+    free(scratch);
+    free(keys);
+    free(sorted);
+
+    return true;
+}
+
+static void ExtractFrames(const char* filename, const Args* args)
+{
+    int w, h;
+    const char* reason;
+    unsigned char* src = LoadImage(filename, &w, &h, &reason);
+
+    if(!src) {
+        fprintf(stderr, "Failed to load image '%s': %s\n", filename, reason);
+		if (args->isDir) {
+			fprintf(stderr, "Skipping...\n");
+		}
+		return;
+    }
+
+    int fw = args->fw;
+    int fh = args->fh;
+    int maxDistFromEdge = args->maxDistFromEdge;
+
+    // Top left pixel is bg color
+    const Pixel* bg = (Pixel*)src;
+
+    printf("Processing image '%s'...\n", filename);
+    printf("image size: %d, %d\n", w, h);
+    printf("bg: %d %d %d %d\n", bg->r, bg->g, bg->b, bg->a);
+
+    bool* checked = calloc(sizeof(bool), w * h);
+
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            const Pixel* p = (Pixel*)(&src[x * 4 + y * (w * 4)]);
+  
+            if(PixelEqual(p, bg)) {
+                continue;
+            } 
+
+    		if (checked[x + y * w]) continue;
+    		
+            // Flood fill to find extents
+            int minX = INT_MAX;
+            int minY = INT_MAX;
+            int maxX = INT_MIN;
+            int maxY = INT_MIN;
+
+            int numPoints = 0;
+            static Point points[MAX_POINTS]; 
+
+            points[numPoints++] = (Point){ x, y, 0 };
+            
+            while(numPoints > 0) {
+                Point pt = points[numPoints - 1];
+                numPoints -= 1;
+
+    			if (pt.x < 0 || pt.y < 0 || pt.x >= w || pt.y >= h) continue;
+    			if (checked[pt.x + pt.y * w]) continue;
+
+                p = (Pixel*)(&src[(pt.x * 4) + pt.y * (w * 4)]);
+
+    			bool isBg = PixelEqual(p, bg);
+                if(isBg && pt.distFromEdge >= maxDistFromEdge) {
+                    continue;
+                }
+
+    			int newDistFromEdge = 0;
+    			if (isBg) {
+    				newDistFromEdge = pt.distFromEdge + 1;
+    			}
+
+    			checked[pt.x + pt.y * w] = true;
+        
+                if(!isBg) {
+                    if(pt.x < minX) {
+                        minX = pt.x;
+                    }
+
+                    if(pt.y < minY) {
+                        minY = pt.y;
+                    }
+                    
+                    if(pt.x > maxX) {
+                        maxX = pt.x;
+                    }
+                    
+                    if(pt.y > maxY) {
+                        maxY = pt.y;
+                    }
+                }
+
+                assert(numPoints < MAX_POINTS);
+
+                points[numPoints++] = (Point){pt.x - 1, pt.y, newDistFromEdge};
+                points[numPoints++] = (Point){pt.x, pt.y - 1, newDistFromEdge};
+                points[numPoints++] = (Point){pt.x + 1, pt.y, newDistFromEdge};
+                points[numPoints++] = (Point){pt.x, pt.y + 1, newDistFromEdge};
+            }
+
+            Rect r = { src, w, h, *bg, minX, minY, maxX - minX + 1, maxY - minY + 1 };
+
+    		if (r.w < args->minW && r.h < args->minH) {
+    			fprintf(stderr, "Found rect (%d,%d,%d,%d) but it's too small so I'm skipping it.\n", r.x, r.y, r.w, r.h);
+    		} else if(r.w > fw) {
+                fprintf(stderr, "Found rect (%d,%d,%d,%d) but it's too large to fit in a single frame so I'm skipping it.\n", r.x, r.y, r.w, r.h);
+            } else {
+                assert(NumFrames < MAX_FRAMES);
+                Frames[NumFrames++] = r;
+            }
+        }
+    }
+
+    free(checked);
+}
+
+static void TraverseImages(tfFILE* file, void* data)
+{
+	ExtractFrames(file->path, data);
+}
+
+// Duplicate frame detection. Frames are hashed (with their background treated as transparent,
+// since frames from different images can have different backgrounds) into an open addressing
+// table keyed on size and hash, and the pixels are compared when those match.
+//
+// To also catch mirrored and rotated copies every frame is hashed in all 8 orientations and the
+// smallest hash is used, which is the same for every orientation of the same pixels.
+#define NUM_TRANSFORMS 8
+
+static unsigned int FramePixel(const Rect* r, int x, int y)
+{
+    const Pixel* p = (const Pixel*)(r->src + ((size_t)(y + r->y) * r->sw + x + r->x) * 4);
+
+    if(PixelEqual(p, &r->bg)) {
+        return 0;
+    }
+
+    return (unsigned int)p->r | (unsigned int)p->g << 8 | (unsigned int)p->b << 16 | (unsigned int)p->a << 24;
+}
+
+// Pixel (x, y) of the frame as seen through transform, see TRANSFORM_*
+static unsigned int TransformedFramePixel(const Rect* r, int transform, int x, int y)
+{
+    int tw = transform & TRANSFORM_TRANSPOSE ? r->h : r->w;
+    int th = transform & TRANSFORM_TRANSPOSE ? r->w : r->h;
+
+    int u = transform & TRANSFORM_MIRROR_X ? tw - 1 - x : x;
+    int v = transform & TRANSFORM_MIRROR_Y ? th - 1 - y : y;
+
+    return transform & TRANSFORM_TRANSPOSE ? FramePixel(r, v, u) : FramePixel(r, u, v);
+}
+
+static unsigned long long HashFramePixels(const Rect* r, int transform)
+{
+    int tw = transform & TRANSFORM_TRANSPOSE ? r->h : r->w;
+    int th = transform & TRANSFORM_TRANSPOSE ? r->w : r->h;
+
+    // FNV-1a over whole pixels
+    unsigned long long hash = 0xcbf29ce484222325ull;
+
+    for(int y = 0; y < th; ++y) {
+        for(int x = 0; x < tw; ++x) {
+            hash = (hash ^ TransformedFramePixel(r, transform, x, y)) * 0x100000001b3ull;
+        }
+    }
+
+    return hash;
+}
+
+// Whether frame b is frame a seen through transform
+static bool FramePixelsEqual(const Rect* a, const Rect* b, int transform)
+{
+    int tw = transform & TRANSFORM_TRANSPOSE ? a->h : a->w;
+    int th = transform & TRANSFORM_TRANSPOSE ? a->w : a->h;
+
+    if(tw != b->w || th != b->h) {
+        return false;
+    }
+
+    for(int y = 0; y < th; ++y) {
+        for(int x = 0; x < tw; ++x) {
+            if(TransformedFramePixel(a, transform, x, y) != FramePixel(b, x, y)) {
+                return false;
+            }
+        }
+    }
+
+    return true;
+}
+
+typedef struct
+{
+    unsigned long long* hashes;
+    int numTransforms;
+} HashJob;
+
+static void HashFrame(void* data, int index, int thread)
+{
+    HashJob* job = data;
+
+    (void)thread;
+
+    unsigned long long best = HashFramePixels(&Frames[index], 0);
+
+    for(int t = 1; t < job->numTransforms; ++t) {
+        unsigned long long hash = HashFramePixels(&Frames[index], t);
+
+        if(hash < best) {
+            best = hash;
+        }
+    }
+
+    job->hashes[index] = best;
+}
+
+// Points the alias of every frame that repeats an earlier one at that frame. With transforms, the
+// repeat may also be a mirrored or rotated copy.
+static bool DedupFrames(bool transforms)
+{
+    unsigned long long* hashes = malloc(sizeof(unsigned long long) * NumFrames);
+
+    int tableSize = 1;
+
+    while(tableSize < NumFrames * 2) {
+        tableSize *= 2;
+    }
+
+    int* table = malloc(sizeof(int) * tableSize);
+
+    if(!hashes || !table) {
+        free(hashes);
+        free(table);
+        return false;
+    }
+
+    HashJob job = { hashes, transforms ? NUM_TRANSFORMS : 1 };
+    ParallelFor(NumFrames, HashFrame, &job);
+
+    for(int i = 0; i < tableSize; ++i) {
+        table[i] = -1;
+    }
+
+    int numDuplicates = 0;
+
+    for(int i = 0; i < NumFrames; ++i) {
+        Rect* r = &Frames[i];
+
+        // Rotations swap the sides, so the key only uses the shorter and longer one
+        unsigned long long minSide = r->w < r->h ? r->w : r->h;
+        unsigned long long maxSide = r->w < r->h ? r->h : r->w;
+        unsigned long long key = hashes[i] ^ (maxSide << 48) ^ (minSide << 32);
+
+        for(int slot = (int)(key & (tableSize - 1));; slot = (slot + 1) & (tableSize - 1)) {
+            int other = table[slot];
+
+            if(other < 0) {
+                table[slot] = i;
+                break;
+            }
+
+            if(hashes[other] != hashes[i]) continue;
+
+            int transform = -1;
+
+            for(int t = 0; t < job.numTransforms && transform < 0; ++t) {
+                if(FramePixelsEqual(&Frames[other], r, t)) {
+                    transform = t;
+                }
+            }
+
+            if(transform >= 0) {
+                r->alias = other;
+                r->transform = transform;
+                numDuplicates += 1;
+                break;
+            }
+        }
+    }
+
+    printf("Found %d duplicate frames.\n", numDuplicates);
+
+    free(hashes);
+    free(table);
+
+    return true;
+}
+
+// Frame resampling for the --scales tiers. Every output pixel is the average of the source area it
+// covers (exact for 0.5, 0.25...). Pixels are premultiplied by alpha with the background made
+// transparent, so it doesn't bleed into the edges. Pixels are kept as 4 floats, one SSE register.
+typedef struct
+{
+    int first;
+    int count;
+    float weights[MAX_RESAMPLE_TAPS];
+} ResampleTaps;
+
+// Taps for shrinking n source pixels to m, m <= n
+static void ComputeResampleTaps(ResampleTaps* taps, int n, int m)
+{
+    float ratio = (float)n / (float)m;
+
+    for(int o = 0; o < m; ++o) {
+        float lo = o * ratio;
+        float hi = (o + 1) * ratio;
+
+        int first = (int)lo;
+        int last = (int)ceilf(hi) - 1;
+
+        if(last >= n) last = n - 1;
+        if(last - first + 1 > MAX_RESAMPLE_TAPS) last = first + MAX_RESAMPLE_TAPS - 1;
+
+        taps[o].first = first;
+        taps[o].count = last - first + 1;
+
+        for(int i = first; i <= last; ++i) {
+            float a = lo > i ? lo : (float)i;
+            float b = hi < i + 1 ? hi : (float)(i + 1);
+
+            taps[o].weights[i - first] = (b - a) / ratio;
+        }
+    }
+}
+
+// dst += src * weight for a 4 channel pixel
+static void AccumulatePixel(float* dst, const float* src, float weight)
+{
+#ifdef USE_SSE2
+    _mm_storeu_ps(dst, _mm_add_ps(_mm_loadu_ps(dst), _mm_mul_ps(_mm_loadu_ps(src), _mm_set1_ps(weight))));
+#else
+    for(int k = 0; k < 4; ++k) {
+        dst[k] += src[k] * weight;
+    }
+#endif
+}
+
+typedef struct
+{
+    const Rect* src;
+    Rect* dst;
+    float scale;
+    bool failed;
+} ResampleJob;
+
+static void ResampleFrame(void* data, int index, int thread)
+{
+    ResampleJob* job = data;
+    const Rect* r = &job->src[index];
+    Rect* out = &job->dst[index];
+
+    (void)thread;
+
+    int w = (int)ceilf(r->w * job->scale);
+    int h = (int)ceilf(r->h * job->scale);
+
+    out->w = w;
+    out->h = h;
+
+    float* premul = malloc(sizeof(float) * 4 * r->w * r->h);
+    float* columns = calloc((size_t)w * r->h * 4, sizeof(float));
+    ResampleTaps* tapsX = malloc(sizeof(ResampleTaps) * w);
+    ResampleTaps* tapsY = malloc(sizeof(ResampleTaps) * h);
+    unsigned char* pixels = malloc((size_t)w * h * 4);
+
+    if(!premul || !columns || !tapsX || !tapsY || !pixels) {
+        free(premul);
+        free(columns);
+        free(tapsX);
+        free(tapsY);
+        free(pixels);
+
+        job->failed = true;
+        return;
+    }
+
+    for(int y = 0; y < r->h; ++y) {
+        const Pixel* row = (const Pixel*)(r->src + ((size_t)(y + r->y) * r->sw + r->x) * 4);
+        float* dst = premul + (size_t)y * r->w * 4;
+
+        for(int x = 0; x < r->w; ++x) {
+            const Pixel* p = &row[x];
+            float a = PixelEqual(p, &r->bg) ? 0.0f : p->a / 255.0f;
+
+            dst[x * 4] = p->r * a;
+            dst[x * 4 + 1] = p->g * a;
+            dst[x * 4 + 2] = p->b * a;
+            dst[x * 4 + 3] = a * 255.0f;
+        }
+    }
+
+    ComputeResampleTaps(tapsX, r->w, w);
+    ComputeResampleTaps(tapsY, r->h, h);
+
+    for(int y = 0; y < r->h; ++y) {
+        const float* src = premul + (size_t)y * r->w * 4;
+        float* dst = columns + (size_t)y * w * 4;
+
+        for(int x = 0; x < w; ++x) {
+            for(int i = 0; i < tapsX[x].count; ++i) {
+                AccumulatePixel(dst + x * 4, src + (tapsX[x].first + i) * 4, tapsX[x].weights[i]);
+            }
+        }
+    }
+
+    for(int y = 0; y < h; ++y) {
+        for(int x = 0; x < w; ++x) {
+            float sum[4] = { 0, 0, 0, 0 };
+
+            for(int i = 0; i < tapsY[y].count; ++i) {
+                AccumulatePixel(sum, columns + ((size_t)(tapsY[y].first + i) * w + x) * 4, tapsY[y].weights[i]);
+            }
+
+            unsigned char* p = pixels + ((size_t)y * w + x) * 4;
+
+            if(sum[3] < 0.5f) {
+                memset(p, 0, 4);
+                continue;
+            }
+
+            for(int k = 0; k < 3; ++k) {
+                p[k] = (unsigned char)Clamp255((int)(sum[k] * 255.0f / sum[3] + 0.5f));
+            }
+
+            p[3] = (unsigned char)Clamp255((int)(sum[3] + 0.5f));
+        }
+    }
+
+    free(premul);
+    free(columns);
+    free(tapsX);
+    free(tapsY);
+
+    // The resampled frame is its own image with a transparent background
+    out->src = pixels;
+    out->sw = w;
+    out->sh = h;
+    out->bg = (Pixel){ 0, 0, 0, 0 };
+    out->x = 0;
+    out->y = 0;
+    out->alias = r->alias;
+    out->transform = r->transform;
+}
+
+// Returns copies of the frames shrunk by scale, or NULL if memory ran out
+static Rect* ScaleFrames(const Rect* frames, int numFrames, float scale)
+{
+    Rect* scaled = calloc(numFrames, sizeof(Rect));
+
+    if(!scaled) {
+        return NULL;
+    }
+
+    ResampleJob job = { frames, scaled, scale, false };
+    ParallelFor(numFrames, ResampleFrame, &job);
+
+    if(job.failed) {
+        for(int i = 0; i < numFrames; ++i) {
+            free(scaled[i].src);
+        }
+
+        free(scaled);
+        return NULL;
+    }
+
+    return scaled;
+}
+
+static int ScaleSize(int size, float scale)
+{
+    int scaled = (int)ceilf(size * scale);
+    return scaled > 0 ? scaled : 1;
+}
+
+// MaxRects packer (Jylanki, "A Thousand Ways to Pack the Bin"). It keeps every maximal free
+// rectangle and places each frame in the free rectangle picked by the heuristic, splitting all
+// free rectangles the frame overlaps. The free and used rectangles are also bucketed into a
+// coarse grid so splitting, pruning and contact scoring only look at nearby rectangles, which keeps
+// it usable with tens of thousands of frames.
+#define MAXRECTS_GRID 64
+
+typedef enum
+{
+    MAXRECTS_BEST_SHORT_SIDE,
+    MAXRECTS_CONTACT_POINT
+} MaxRectsHeuristic;
+
+typedef struct
+{
+    int x, y, w, h;
+} PackRect;
+
+typedef struct
+{
+    int* items;
+    int count, capacity;
+} IntList;
+
+typedef struct
+{
+    PackRect* items;
+    int count, capacity;
+} PackRectList;
+
+typedef struct
+{
+    int binW, binH;
+    int cellW, cellH;
+
+    // Free rectangles are never reused, dead ones are skipped (and dropped from the cells) lazily
+    PackRect* free;
+    bool* alive;
+    int numFree, freeCapacity;
+
+    // Alive free rectangles, with their position in this list so they can be removed quickly
+    IntList active;
+    int* activePos;
+
+    PackRect* used;
+    int numUsed;
+
+    IntList freeCells[MAXRECTS_GRID * MAXRECTS_GRID];
+    IntList usedCells[MAXRECTS_GRID * MAXRECTS_GRID];
+
+    // Marks rectangles already seen by the current query, which can find them in several cells
+    int* freeStamp;
+    int* usedStamp;
+    int stamp;
+
+    bool failed;
+} MaxRects;
+
+static void PackRectListPush(PackRectList* list, PackRect value, bool* failed)
+{
+    if(list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 16;
+        PackRect* items = realloc(list->items, sizeof(PackRect) * capacity);
+
+        if(!items) {
+            *failed = true;
+            return;
+        }
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = value;
+}
+
+static void IntListPush(IntList* list, int value, bool* failed)
+{
+    if(list->count == list->capacity) {
+        int capacity = list->capacity ? list->capacity * 2 : 8;
+        int* items = realloc(list->items, sizeof(int) * capacity);
+
+        if(!items) {
+            *failed = true;
+            return;
+        }
+
+        list->items = items;
+        list->capacity = capacity;
+    }
+
+    list->items[list->count++] = value;
+}
+
+// Range of grid cells the rectangle overlaps (inclusive)
+static void MaxRectsCells(const MaxRects* mr, const PackRect* r, int* x0, int* y0, int* x1, int* y1)
+{
+    *x0 = r->x / mr->cellW;
+    *y0 = r->y / mr->cellH;
+    *x1 = (r->x + r->w - 1) / mr->cellW;
+    *y1 = (r->y + r->h - 1) / mr->cellH;
+
+    if(*x0 < 0) *x0 = 0;
+    if(*y0 < 0) *y0 = 0;
+    if(*x1 >= MAXRECTS_GRID) *x1 = MAXRECTS_GRID - 1;
+    if(*y1 >= MAXRECTS_GRID) *y1 = MAXRECTS_GRID - 1;
+}
+
+static void MaxRectsAddFree(MaxRects* mr, PackRect r)
+{
+    if(mr->numFree == mr->freeCapacity) {
+        int capacity = mr->freeCapacity ? mr->freeCapacity * 2 : 256;
+
+        PackRect* free = realloc(mr->free, sizeof(PackRect) * capacity);
+        if(free) mr->free = free;
+
+        bool* alive = realloc(mr->alive, sizeof(bool) * capacity);
+        if(alive) mr->alive = alive;
+
+        int* activePos = realloc(mr->activePos, sizeof(int) * capacity);
+        if(activePos) mr->activePos = activePos;
+
+        int* freeStamp = realloc(mr->freeStamp, sizeof(int) * capacity);
+        if(freeStamp) mr->freeStamp = freeStamp;
+
+        if(!free || !alive || !activePos || !freeStamp) {
+            mr->failed = true;
+            return;
+        }
+
+        mr->freeCapacity = capacity;
+    }
+
+    int id = mr->numFree++;
+
+    mr->free[id] = r;
+    mr->alive[id] = true;
+    mr->freeStamp[id] = 0;
+    mr->activePos[id] = mr->active.count;
+
+    IntListPush(&mr->active, id, &mr->failed);
+
+    int x0, y0, x1, y1;
+    MaxRectsCells(mr, &r, &x0, &y0, &x1, &y1);
+
+    for(int cy = y0; cy <= y1; ++cy) {
+        for(int cx = x0; cx <= x1; ++cx) {
+            IntListPush(&mr->freeCells[cy * MAXRECTS_GRID + cx], id, &mr->failed);
+        }
+    }
+}
+
+static void MaxRectsRemoveFree(MaxRects* mr, int id)
+{
+    int pos = mr->activePos[id];
+    int last = mr->active.items[--mr->active.count];
+
+    mr->active.items[pos] = last;
+    mr->activePos[last] = pos;
+    mr->alive[id] = false;
+}
+
+// Collects the alive free rectangles overlapping r into out, each once
+static void MaxRectsQueryFree(MaxRects* mr, const PackRect* r, IntList* out)
+{
+    int x0, y0, x1, y1;
+    MaxRectsCells(mr, r, &x0, &y0, &x1, &y1);
+
+    mr->stamp += 1;
+    out->count = 0;
+
+    for(int cy = y0; cy <= y1; ++cy) {
+        for(int cx = x0; cx <= x1; ++cx) {
+            IntList* cell = &mr->freeCells[cy * MAXRECTS_GRID + cx];
+            int kept = 0;
+
+            for(int i = 0; i < cell->count; ++i) {
+                int id = cell->items[i];
+
+                if(!mr->alive[id]) continue;
+
+                cell->items[kept++] = id;
+
+                if(mr->freeStamp[id] == mr->stamp) continue;
+                mr->freeStamp[id] = mr->stamp;
+
+                const PackRect* f = &mr->free[id];
+
+                if(f->x < r->x + r->w && r->x < f->x + f->w && f->y < r->y + r->h && r->y < f->y + f->h) {
+                    IntListPush(out, id, &mr->failed);
+                }
+            }
+
+            cell->count = kept;
+        }
+    }
+}
+
+static bool PackRectContains(const PackRect* a, const PackRect* b)
+{
+    return b->x >= a->x && b->y >= a->y && b->x + b->w <= a->x + a->w && b->y + b->h <= a->y + a->h;
+}
+
+// Length of overlap between [a0, a1) and [b0, b1)
+static int SpanOverlap(int a0, int a1, int b0, int b1)
+{
+    int lo = a0 > b0 ? a0 : b0;
+    int hi = a1 < b1 ? a1 : b1;
+
+    return hi > lo ? hi - lo : 0;
+}
+
+// How much of the rectangle's perimeter touches the bin edges or already placed rectangles
+static int MaxRectsContactScore(MaxRects* mr, const PackRect* r)
+{
+    int score = 0;
+
+    if(r->x == 0 || r->x + r->w == mr->binW) score += r->h;
+    if(r->y == 0 || r->y + r->h == mr->binH) score += r->w;
+
+    PackRect around = { r->x - 1, r->y - 1, r->w + 2, r->h + 2 };
+
+    int x0, y0, x1, y1;
+    MaxRectsCells(mr, &around, &x0, &y0, &x1, &y1);
+
+    mr->stamp += 1;
+
+    for(int cy = y0; cy <= y1; ++cy) {
+        for(int cx = x0; cx <= x1; ++cx) {
+            // Only the border cells can hold rectangles touching the outside of r
+            if(cy > y0 && cy < y1 && cx > x0 && cx < x1) continue;
+
+            const IntList* cell = &mr->usedCells[cy * MAXRECTS_GRID + cx];
+
+            for(int i = 0; i < cell->count; ++i) {
+                int id = cell->items[i];
+
+                if(mr->usedStamp[id] == mr->stamp) continue;
+                mr->usedStamp[id] = mr->stamp;
+
+                const PackRect* u = &mr->used[id];
+
+                if(u->x == r->x + r->w || u->x + u->w == r->x) {
+                    score += SpanOverlap(r->y, r->y + r->h, u->y, u->y + u->h);
+                }
+
+                if(u->y == r->y + r->h || u->y + u->h == r->y) {
+                    score += SpanOverlap(r->x, r->x + r->w, u->x, u->x + u->w);
+                }
+            }
+        }
+    }
+
+    return score;
+}
+
+// Scores every free rectangle a w x h rectangle fits in, updating best if one beats the score so far
+static void MaxRectsScoreFree(MaxRects* mr, int w, int h, MaxRectsHeuristic heuristic, PackRect* best, int* bestScore, int* bestTie)
+{
+    for(int i = 0; i < mr->active.count; ++i) {
+        const PackRect* f = &mr->free[mr->active.items[i]];
+
+        if(f->w < w || f->h < h) continue;
+
+        int score;
+        int tie;
+
+        if(heuristic == MAXRECTS_CONTACT_POINT) {
+            PackRect r = { f->x, f->y, w, h };
+
+            // Higher contact is better, ties go to the top-left most position
+            score = -MaxRectsContactScore(mr, &r);
+            tie = f->y * mr->binW + f->x;
+        } else {
+            int leftoverW = f->w - w;
+            int leftoverH = f->h - h;
+
+            score = leftoverW < leftoverH ? leftoverW : leftoverH;
+            tie = leftoverW < leftoverH ? leftoverH : leftoverW;
+        }
+
+        if(score < *bestScore || (score == *bestScore && tie < *bestTie)) {
+            *bestScore = score;
+            *bestTie = tie;
+
+            best->x = f->x;
+            best->y = f->y;
+            best->w = w;
+            best->h = h;
+        }
+    }
+}
+
+// Picks where a w x h rectangle goes, trying it sideways as well if rotate is set. Returns false if
+// it fits nowhere.
+static bool MaxRectsFindPosition(MaxRects* mr, int w, int h, MaxRectsHeuristic heuristic, bool rotate, PackRect* best)
+{
+    int bestScore = INT_MAX;
+    int bestTie = INT_MAX;
+
+    int numOrientations = rotate && w != h ? 2 : 1;
+
+    for(int o = 0; o < numOrientations; ++o) {
+        if(o == 1) {
+            int t = w;
+            w = h;
+            h = t;
+        }
+
+        MaxRectsScoreFree(mr, w, h, heuristic, best, &bestScore, &bestTie);
+    }
+
+    return bestScore != INT_MAX;
+}
+
+static void MaxRectsPlace(MaxRects* mr, const PackRect* r, IntList* overlaps, PackRectList* parts)
+{
+    // Record the used rectangle (only needed for contact scoring)
+    mr->used[mr->numUsed] = *r;
+    mr->usedStamp[mr->numUsed] = 0;
+
+    int x0, y0, x1, y1;
+    MaxRectsCells(mr, r, &x0, &y0, &x1, &y1);
+
+    for(int cy = y0; cy <= y1; ++cy) {
+        for(int cx = x0; cx <= x1; ++cx) {
+            IntListPush(&mr->usedCells[cy * MAXRECTS_GRID + cx], mr->numUsed, &mr->failed);
+        }
+    }
+
+    mr->numUsed += 1;
+
+    // Split every free rectangle the new one overlaps into the (up to 4) maximal parts around it
+    MaxRectsQueryFree(mr, r, overlaps);
+
+    parts->count = 0;
+
+    for(int i = 0; i < overlaps->count; ++i) {
+        int id = overlaps->items[i];
+        PackRect f = mr->free[id];
+
+        MaxRectsRemoveFree(mr, id);
+
+        PackRect split[4];
+        int numSplit = 0;
+
+        if(r->x > f.x) split[numSplit++] = (PackRect){ f.x, f.y, r->x - f.x, f.h };
+        if(r->x + r->w < f.x + f.w) split[numSplit++] = (PackRect){ r->x + r->w, f.y, f.x + f.w - r->x - r->w, f.h };
+        if(r->y > f.y) split[numSplit++] = (PackRect){ f.x, f.y, f.w, r->y - f.y };
+        if(r->y + r->h < f.y + f.h) split[numSplit++] = (PackRect){ f.x, r->y + r->h, f.w, f.y + f.h - r->y - r->h };
+
+        for(int k = 0; k < numSplit; ++k) {
+            PackRectListPush(parts, split[k], &mr->failed);
+        }
+    }
+
+    if(mr->failed) {
+        return;
+    }
+
+    // The old free rectangles are all maximal, so only the new parts can be contained in another one
+    for(int i = 0; i < parts->count; ++i) {
+        const PackRect* part = &parts->items[i];
+        bool contained = false;
+
+        for(int j = 0; j < parts->count && !contained; ++j) {
+            if(i == j) continue;
+
+            // Of two identical parts the later one is kept
+            if(PackRectContains(&parts->items[j], part) && (j > i || !PackRectContains(part, &parts->items[j]))) {
+                contained = true;
+            }
+        }
+
+        // Anything containing the part covers its top-left pixel, so only that cell needs looking at
+        if(!contained) {
+            PackRect corner = { part->x, part->y, 1, 1 };
+            MaxRectsQueryFree(mr, &corner, overlaps);
+
+            for(int j = 0; j < overlaps->count && !contained; ++j) {
+                contained = PackRectContains(&mr->free[overlaps->items[j]], part);
+            }
+        }
+
+        if(!contained) {
+            MaxRectsAddFree(mr, *part);
+        }
+    }
+}
+
+static void MaxRectsDestroy(MaxRects* mr)
+{
+    for(int i = 0; i < MAXRECTS_GRID * MAXRECTS_GRID; ++i) {
+        free(mr->freeCells[i].items);
+        free(mr->usedCells[i].items);
+    }
+
+    free(mr->free);
+    free(mr->alive);
+    free(mr->active.items);
+    free(mr->activePos);
+    free(mr->used);
+    free(mr->freeStamp);
+    free(mr->usedStamp);
+    free(mr);
+}
+
+// Packs the rectangles in the given order. Returns whether all of them fit. Without PACK_PARTIAL it
+// gives up on the first one that doesn't, otherwise that one is skipped.
+static bool MaxRectsPack(stbrp_rect* rects, int numRects, int binW, int binH, MaxRectsHeuristic heuristic, int flags)
+{
+    MaxRects* mr = calloc(1, sizeof(MaxRects));
+
+    if(!mr) {
+        return false;
+    }
+
+    mr->binW = binW;
+    mr->binH = binH;
+    mr->cellW = (binW + MAXRECTS_GRID - 1) / MAXRECTS_GRID;
+    mr->cellH = (binH + MAXRECTS_GRID - 1) / MAXRECTS_GRID;
+    mr->used = malloc(sizeof(PackRect) * (numRects > 0 ? numRects : 1));
+    mr->usedStamp = malloc(sizeof(int) * (numRects > 0 ? numRects : 1));
+
+    if(!mr->used || !mr->usedStamp) {
+        MaxRectsDestroy(mr);
+        return false;
+    }
+
+    MaxRectsAddFree(mr, (PackRect){ 0, 0, binW, binH });
+
+    IntList overlaps = { 0 };
+    PackRectList parts = { 0 };
+
+    // Kept rectangles go in first, the ones whose spot is taken (or off the bin) are packed like the rest
+    for(int i = 0; (flags & PACK_KEEP) && i < numRects && !mr->failed; ++i) {
+        stbrp_rect* rect = &rects[i];
+        PackRect r = { rect->x, rect->y, rect->w, rect->h };
+
+        if(!rect->was_packed || r.w == 0 || r.h == 0) continue;
+
+        bool isFree = false;
+
+        if(r.x + r.w <= binW && r.y + r.h <= binH) {
+            PackRect corner = { r.x, r.y, 1, 1 };
+            MaxRectsQueryFree(mr, &corner, &overlaps);
+
+            for(int j = 0; j < overlaps.count && !isFree; ++j) {
+                isFree = PackRectContains(&mr->free[overlaps.items[j]], &r);
+            }
+        }
+
+        if(isFree) {
+            MaxRectsPlace(mr, &r, &overlaps, &parts);
+        } else {
+            rect->was_packed = 0;
+        }
+    }
+
+    bool allPacked = true;
+
+    for(int i = 0; i < numRects && !mr->failed; ++i) {
+        stbrp_rect* rect = &rects[i];
+        PackRect r;
+
+        if((flags & PACK_KEEP) && rect->was_packed) continue;
+
+        rect->was_packed = rect->w == 0 || rect->h == 0;
+
+        if(rect->was_packed) {
+            rect->x = 0;
+            rect->y = 0;
+            continue;
+        }
+
+        if(!MaxRectsFindPosition(mr, rect->w, rect->h, heuristic, (flags & PACK_ROTATE) != 0, &r)) {
+            allPacked = false;
+
+            if(flags & PACK_PARTIAL) continue;
+            break;
+        }
+
+        MaxRectsPlace(mr, &r, &overlaps, &parts);
+
+        rect->x = r.x;
+        rect->y = r.y;
+        rect->was_packed = 1;
+
+        if(r.w != rect->w) {
+            rect->w = r.w;
+            rect->h = r.h;
+            rect->was_packed = PACKED_ROTATED;
+        }
+    }
+
+    allPacked = allPacked && !mr->failed;
+
+    free(overlaps.items);
+    free(parts.items);
+    MaxRectsDestroy(mr);
+
+    return allPacked;
+}
+
+// Orders the --packer best portfolio tries, biggest first by each measure. Ties go to the taller,
+// then wider rectangle and finally the id, which keeps the order stable.
+typedef enum
+{
+    PACK_ORDER_HEIGHT,
+    PACK_ORDER_AREA,
+    PACK_ORDER_PERIMETER,
+    PACK_ORDER_MAX_SIDE,
+    NUM_PACK_ORDERS
+} PackOrder;
+
+static const char* PackOrderNames[NUM_PACK_ORDERS] = { "height", "area", "perimeter", "max-side" };
+
+static int ComparePackHeight(const void* a, const void* b)
+{
+    const stbrp_rect* ra = a;
+    const stbrp_rect* rb = b;
+
+    if(ra->h != rb->h) return rb->h - ra->h;
+    if(ra->w != rb->w) return rb->w - ra->w;
+
+    return ra->id - rb->id;
+}
+
+static int ComparePackArea(const void* a, const void* b)
+{
+    const stbrp_rect* ra = a;
+    const stbrp_rect* rb = b;
+
+    long long areaA = (long long)ra->w * ra->h;
+    long long areaB = (long long)rb->w * rb->h;
+
+    if(areaA != areaB) return areaA < areaB ? 1 : -1;
+
+    return ComparePackHeight(a, b);
+}
+
+static int ComparePackPerimeter(const void* a, const void* b)
+{
+    const stbrp_rect* ra = a;
+    const stbrp_rect* rb = b;
+
+    int perimeterA = ra->w + ra->h;
+    int perimeterB = rb->w + rb->h;
+
+    if(perimeterA != perimeterB) return perimeterB - perimeterA;
+
+    return ComparePackHeight(a, b);
+}
+
+static int ComparePackMaxSide(const void* a, const void* b)
+{
+    const stbrp_rect* ra = a;
+    const stbrp_rect* rb = b;
+
+    int maxA = ra->w > ra->h ? ra->w : ra->h;
+    int maxB = rb->w > rb->h ? rb->w : rb->h;
+
+    if(maxA != maxB) return maxB - maxA;
+
+    return ComparePackHeight(a, b);
+}
+
+static int (*const PackOrderCompares[NUM_PACK_ORDERS])(const void*, const void*) = {
+    ComparePackHeight, ComparePackArea, ComparePackPerimeter, ComparePackMaxSide
+};
+
+static const char* PackerNames[] = { "skyline", "skyline-bf", "maxrects", "maxrects-contact", "shelf", "best" };
+
+// Skyline packing in the given order (stbrp_pack_rects always sorts by height). Without PACK_PARTIAL
+// it gives up on the first rectangle that doesn't fit.
+// This calls stbrp__skyline_find_best_pos and stbrp__skyline_pack_rectangle, which are internals of
+// the stb_rect_pack.h v0.11 in this repo rather than its API. Check them again when updating the header.
+static bool SkylinePack(stbrp_rect* rects, int numRects, int binW, int binH, int heuristic, int flags)
+{
+    stbrp_node* nodes = malloc(sizeof(stbrp_node) * binW);
+
+    if(!nodes) {
+        return false;
+    }
+
+    stbrp_context ctx;
+
+    stbrp_init_target(&ctx, binW, binH, nodes, binW);
+    stbrp_setup_heuristic(&ctx, heuristic);
+
+    bool allPacked = true;
+
+    for(int i = 0; i < numRects; ++i) {
+        stbrp_rect* rect = &rects[i];
+
+        if(rect->w == 0 || rect->h == 0) {
+            rect->x = 0;
+            rect->y = 0;
+            rect->was_packed = 1;
+            continue;
+        }
+
+        bool rotated = false;
+
+        if((flags & PACK_ROTATE) && rect->w != rect->h) {
+            stbrp__findresult upright = stbrp__skyline_find_best_pos(&ctx, rect->w, rect->h);
+            stbrp__findresult sideways = stbrp__skyline_find_best_pos(&ctx, rect->h, rect->w);
+
+            bool uprightFits = upright.prev_link && upright.y + rect->h <= binH;
+            bool sidewaysFits = sideways.prev_link && sideways.y + rect->w <= binH;
+
+            // Whichever way leaves the lower top edge keeps the skyline flatter
+            rotated = sidewaysFits && (!uprightFits || sideways.y + rect->w < upright.y + rect->h);
+        }
+
+        stbrp__findresult fr = stbrp__skyline_pack_rectangle(&ctx, rotated ? rect->h : rect->w, rotated ? rect->w : rect->h);
+
+        rect->was_packed = fr.prev_link != NULL;
+
+        if(!rect->was_packed) {
+            allPacked = false;
+
+            if(flags & PACK_PARTIAL) continue;
+            break;
+        }
+
+        rect->x = fr.x;
+        rect->y = fr.y;
+
+        if(rotated) {
+            int w = rect->w;
+
+            rect->w = rect->h;
+            rect->h = w;
+            rect->was_packed = PACKED_ROTATED;
+        }
+    }
+
+    free(nodes);
+
+    return allPacked;
+}
+
+// Next fit decreasing height: the rectangles (sorted tallest first) go left to right on a shelf as tall
+// as its first one, and a new shelf is started on top of it once the next one doesn't fit across. Only
+// the current shelf is kept around, so this is linear after the sort and needs no skyline nodes.
+static bool ShelfPack(stbrp_rect* rects, int numRects, int binW, int binH, int flags)
+{
+    int shelfX = 0;
+    int shelfY = 0;
+    int shelfH = 0;
+
+    bool allPacked = true;
+
+    for(int i = 0; i < numRects; ++i) {
+        stbrp_rect* rect = &rects[i];
+
+        if(rect->w == 0 || rect->h == 0) {
+            rect->x = 0;
+            rect->y = 0;
+            rect->was_packed = 1;
+            continue;
+        }
+
+        int w = rect->w;
+        int h = rect->h;
+
+        // Standing a lying frame up takes less of the shelf as long as it's not taller than the shelf
+        bool rotated = (flags & PACK_ROTATE) && w > h && w <= shelfH && shelfX + h <= binW;
+
+        if(rotated) {
+            w = rect->h;
+            h = rect->w;
+        }
+
+        if(shelfX + w > binW && w <= binW) {
+            shelfY += shelfH;
+            shelfX = 0;
+            shelfH = 0;
+        }
+
+        rect->was_packed = w <= binW && shelfY + (h > shelfH ? h : shelfH) <= binH;
+
+        if(!rect->was_packed) {
+            allPacked = false;
+
+            if(flags & PACK_PARTIAL) continue;
+            break;
+        }
+
+        rect->x = shelfX;
+        rect->y = shelfY;
+
+        shelfX += w;
+
+        if(h > shelfH) shelfH = h;
+
+        if(rotated) {
+            rect->w = w;
+            rect->h = h;
+            rect->was_packed = PACKED_ROTATED;
+        }
+    }
+
+    return allPacked;
+}
+
+// Packs the rectangles in the order they're in with any packer but PACKER_BEST
+static bool PackInOrder(stbrp_rect* rects, int numRects, int binW, int binH, Packer packer, int flags)
+{
+    switch(packer) {
+        case PACKER_SKYLINE: return SkylinePack(rects, numRects, binW, binH, STBRP_HEURISTIC_Skyline_BL_sortHeight, flags);
+        case PACKER_SKYLINE_BF: return SkylinePack(rects, numRects, binW, binH, STBRP_HEURISTIC_Skyline_BF_sortHeight, flags);
+        case PACKER_MAXRECTS: return MaxRectsPack(rects, numRects, binW, binH, MAXRECTS_BEST_SHORT_SIDE, flags);
+        case PACKER_MAXRECTS_CONTACT: return MaxRectsPack(rects, numRects, binW, binH, MAXRECTS_CONTACT_POINT, flags);
+        case PACKER_SHELF: return ShelfPack(rects, numRects, binW, binH, flags);
+        default: return false;
+    }
+}
+
+// The --packer best portfolio: every one of these packers with every PackOrder
+static const Packer PortfolioPackers[] = { PACKER_SKYLINE, PACKER_SKYLINE_BF, PACKER_MAXRECTS, PACKER_MAXRECTS_CONTACT };
+
+#define NUM_PORTFOLIO_PACKERS (int)(sizeof(PortfolioPackers) / sizeof(PortfolioPackers[0]))
+#define NUM_PACK_CANDIDATES (NUM_PORTFOLIO_PACKERS * NUM_PACK_ORDERS)
+
+typedef struct
+{
+    const stbrp_rect* rects;
+    int numRects;
+    int binW, binH;
+    int flags;
+
+    // Every candidate packs its own copy of the rectangles
+    stbrp_rect* results[NUM_PACK_CANDIDATES];
+    bool packed[NUM_PACK_CANDIDATES];
+
+    // Area of the rectangles that fit (all of them without PACK_PARTIAL) and the size of the area they cover
+    long long placedArea[NUM_PACK_CANDIDATES];
+    int numPlaced[NUM_PACK_CANDIDATES];
+    int usedW[NUM_PACK_CANDIDATES];
+    int usedH[NUM_PACK_CANDIDATES];
+} PortfolioJob;
+
+static void PackCandidate(void* data, int index, int thread)
+{
+    PortfolioJob* job = data;
+
+    (void)thread;
+
+    stbrp_rect* rects = malloc(sizeof(stbrp_rect) * (job->numRects > 0 ? job->numRects : 1));
+
+    job->results[index] = rects;
+    job->packed[index] = false;
+    job->placedArea[index] = 0;
+    job->numPlaced[index] = 0;
+    job->usedW[index] = 0;
+    job->usedH[index] = 0;
+
+    if(!rects) {
+        return;
+    }
+
+    memcpy(rects, job->rects, sizeof(stbrp_rect) * job->numRects);
+    qsort(rects, job->numRects, sizeof(stbrp_rect), PackOrderCompares[index % NUM_PACK_ORDERS]);
+
+    job->packed[index] = PackInOrder(rects, job->numRects, job->binW, job->binH, PortfolioPackers[index / NUM_PACK_ORDERS], job->flags);
+
+    if(!job->packed[index] && !(job->flags & PACK_PARTIAL)) {
+        return;
+    }
+
+    for(int i = 0; i < job->numRects; ++i) {
+        if(!rects[i].was_packed) continue;
+
+        if(rects[i].x + rects[i].w > job->usedW[index]) job->usedW[index] = rects[i].x + rects[i].w;
+        if(rects[i].y + rects[i].h > job->usedH[index]) job->usedH[index] = rects[i].y + rects[i].h;
+
+        job->placedArea[index] += (long long)rects[i].w * rects[i].h;
+        job->numPlaced[index] += 1;
+    }
+}
+
+// Runs every candidate of the portfolio in parallel and keeps the one whose rectangles cover the
+// smallest area, i.e. the most occupied one. With PACK_PARTIAL, candidates may leave rectangles out
+// and the one fitting the most area is kept instead. The occupancy of every candidate is printed
+// unless name is NULL.
+static bool PackPortfolio(stbrp_rect* rects, int numRects, int binW, int binH, const char* name, int flags)
+{
+    PortfolioJob job = { rects, numRects, binW, binH, flags };
+
+    ParallelFor(NUM_PACK_CANDIDATES, PackCandidate, &job);
+
+    int best = -1;
+
+    for(int i = 0; i < NUM_PACK_CANDIDATES; ++i) {
+        if(!job.packed[i] && (!(flags & PACK_PARTIAL) || job.numPlaced[i] == 0)) continue;
+
+        long long usedArea = (long long)job.usedW[i] * job.usedH[i];
+        long long bestUsedArea = best < 0 ? 0 : (long long)job.usedW[best] * job.usedH[best];
+
+        if(best < 0 || job.placedArea[i] > job.placedArea[best] ||
+           (job.placedArea[i] == job.placedArea[best] && usedArea < bestUsedArea)) {
+            best = i;
+        }
+    }
+
+    if(name) {
+        // The report is printed at once so the ones of several --scales tiers don't interleave
+        char report[4096];
+        int len = snprintf(report, sizeof(report), "Packing '%s' into %dx%d:\n%-18s %-10s %10s %12s %8s\n",
+                           name, binW, binH, "packer", "order", "occupancy", "used size", "frames");
+
+        for(int i = 0; i < NUM_PACK_CANDIDATES && len < (int)sizeof(report); ++i) {
+            const char* packer = PackerNames[PortfolioPackers[i / NUM_PACK_ORDERS]];
+            const char* order = PackOrderNames[i % NUM_PACK_ORDERS];
+
+            if(job.numPlaced[i] == 0) {
+                len += snprintf(report + len, sizeof(report) - len, "%-18s %-10s %10s\n", packer, order, "no fit");
+            } else {
+                char used[32];
+                snprintf(used, sizeof(used), "%dx%d", job.usedW[i], job.usedH[i]);
+
+                len += snprintf(report + len, sizeof(report) - len, "%-18s %-10s %9.1f%% %12s %8d%s\n", packer,
+                                order, 100.0 * job.placedArea[i] / ((double)job.usedW[i] * job.usedH[i]), used,
+                                job.numPlaced[i], i == best ? "  <- kept" : "");
+            }
+        }
+
+        fputs(report, stdout);
+    }
+
+    if(best >= 0) {
+        memcpy(rects, job.results[best], sizeof(stbrp_rect) * numRects);
+    }
+
+    for(int i = 0; i < NUM_PACK_CANDIDATES; ++i) {
+        free(job.results[i]);
+    }
+
+    return best >= 0 && job.packed[best];
+}
+
+// Packs the rectangles into a binW x binH atlas with the PACK_* flags. Returns whether all of them
+// fit. With PACK_PARTIAL, as many as possible are packed and was_packed tells which ones made it.
+// name is the output the --packer best report is printed for, or NULL to keep quiet.
+static bool PackRects(stbrp_rect* rects, int numRects, int binW, int binH, Packer packer, const char* name, int flags)
+{
+    if(packer == PACKER_BEST) {
+        return PackPortfolio(rects, numRects, binW, binH, name, flags);
+    }
+
+    if((packer == PACKER_SKYLINE || packer == PACKER_SKYLINE_BF) && !(flags & PACK_ROTATE)) {
+        stbrp_node* nodes = malloc(sizeof(stbrp_node) * binW);
+
+        if(!nodes) {
+            return false;
+        }
+
+        stbrp_context ctx;
+
+        stbrp_init_target(&ctx, binW, binH, nodes, binW);
+        stbrp_setup_heuristic(&ctx, packer == PACKER_SKYLINE_BF ? STBRP_HEURISTIC_Skyline_BF_sortHeight : STBRP_HEURISTIC_Skyline_BL_sortHeight);
+
+        bool allPacked = stbrp_pack_rects(&ctx, rects, numRects) == 1;
+
+        free(nodes);
+
+        return allPacked;
+    }
+
+    // Otherwise the frames go tallest first like stbrp_pack_rects does
+    qsort(rects, numRects, sizeof(stbrp_rect), ComparePackHeight);
+
+    return PackInOrder(rects, numRects, binW, binH, packer, flags);
+}
+
+// Synthetic frame sets for --bench-pack, sides are picked from [min, max] with the random value
+// raised to skew so higher powers favour small frames. Thin sets make one of the sides minSide.
+typedef struct
+{
+    const char* name;
+    int minSide, maxSide;
+    int skew;
+    bool thin;
+} BenchPackSet;
+
+static const BenchPackSet BenchPackSets[] = {
+    { "tiles", 8, 32, 1, false },
+    { "mixed", 4, 128, 3, false },
+    { "strips", 4, 64, 2, true },
+};
+
+#define NUM_BENCH_PACK_SETS (int)(sizeof(BenchPackSets) / sizeof(BenchPackSets[0]))
+
+static int BenchPackSide(unsigned int* seed, const BenchPackSet* set)
+{
+    *seed = *seed * 1664525u + 1013904223u;
+
+    double t = (*seed >> 8) / (double)(1 << 24);
+    double v = t;
+
+    for(int i = 1; i < set->skew; ++i) {
+        v *= t;
+    }
+
+    return set->minSide + (int)(v * (set->maxSide - set->minSide + 1));
+}
+
+// Packs numFrames random frames of every BenchPackSet with every packer into a square a quarter
+// larger than their area and prints how long it took and how occupied the covered area is
+static bool BenchmarkPackers(int numFrames)
+{
+    stbrp_rect* frames = malloc(sizeof(stbrp_rect) * numFrames);
+    stbrp_rect* rects = malloc(sizeof(stbrp_rect) * numFrames);
+
+    if(!frames || !rects) {
+        fprintf(stderr, "Failed to allocate %d frames.\n", numFrames);
+        free(frames);
+        free(rects);
+        return false;
+    }
+
+    printf("%-8s %-18s %12s %10s %14s\n", "set", "packer", "time (ms)", "occupancy", "used size");
+
+    for(int s = 0; s < NUM_BENCH_PACK_SETS; ++s) {
+        const BenchPackSet* set = &BenchPackSets[s];
+        unsigned int seed = 12345;
+        long long area = 0;
+
+        for(int i = 0; i < numFrames; ++i) {
+            memset(&frames[i], 0, sizeof(stbrp_rect));
+
+            frames[i].id = i;
+            frames[i].w = BenchPackSide(&seed, set);
+            frames[i].h = BenchPackSide(&seed, set);
+
+            if(set->thin && i % 2 == 0) {
+                frames[i].h = set->minSide;
+            } else if(set->thin) {
+                frames[i].w = set->minSide;
+            }
+
+            area += (long long)frames[i].w * frames[i].h;
+        }
+
+        int side = (int)ceil(sqrt(area * 1.25));
+
+        if(side < set->maxSide) side = set->maxSide;
+
+        if(side > PACK_AUTO_MAX_SIZE) {
+            fprintf(stderr, "%d frames don't fit into %dx%d.\n", numFrames, PACK_AUTO_MAX_SIZE, PACK_AUTO_MAX_SIZE);
+            free(frames);
+            free(rects);
+            return false;
+        }
+
+        for(int p = 0; p < PACKER_BEST; ++p) {
+            memcpy(rects, frames, sizeof(stbrp_rect) * numFrames);
+
+            double start = GetSeconds();
+            bool packed = PackRects(rects, numFrames, side, side, (Packer)p, NULL, 0);
+            double elapsed = GetSeconds() - start;
+
+            if(!packed) {
+                printf("%-8s %-18s %12.2f %10s\n", set->name, PackerNames[p], elapsed * 1000.0, "no fit");
+                continue;
+            }
+
+            int usedW = 0;
+            int usedH = 0;
+
+            for(int i = 0; i < numFrames; ++i) {
+                if(rects[i].x + rects[i].w > usedW) usedW = rects[i].x + rects[i].w;
+                if(rects[i].y + rects[i].h > usedH) usedH = rects[i].y + rects[i].h;
+            }
+
+            char used[32];
+            snprintf(used, sizeof(used), "%dx%d", usedW, usedH);
+
+            printf("%-8s %-18s %12.2f %9.1f%% %14s\n", set->name, PackerNames[p], elapsed * 1000.0,
+                   100.0 * area / ((double)usedW * usedH), used);
+        }
+    }
+
+    free(frames);
+    free(rects);
+
+    return true;
+}
+
+static int NextPowerOfTwo(int v)
+{
+    int p = 1;
+
+    while(p < v) {
+        p *= 2;
+    }
+
+    return p;
+}
+
+// --pack auto. Every job takes one width and finds the smallest height the rectangles fit in.
+typedef struct
+{
+    const stbrp_rect* rects;
+    int numRects;
+    Packer packer;
+    int flags;
+    bool pot;
+
+    long long area;
+    int minH, maxH;
+
+    // A height of 0 means nothing up to maxH fits
+    int widths[32];
+    int heights[32];
+} PackSizeJob;
+
+static bool PacksInto(const PackSizeJob* job, stbrp_rect* scratch, int w, int h)
+{
+    memcpy(scratch, job->rects, sizeof(stbrp_rect) * job->numRects);
+    return PackRects(scratch, job->numRects, w, h, job->packer, NULL, job->flags);
+}
+
+static void FindPackHeight(void* data, int index, int thread)
+{
+    PackSizeJob* job = data;
+    int w = job->widths[index];
+
+    (void)thread;
+
+    job->heights[index] = 0;
+
+    long long bound = (job->area + w - 1) / w;
+    int h = bound > job->minH ? (int)(bound < job->maxH ? bound : job->maxH) : job->minH;
+
+    if(job->pot) {
+        h = NextPowerOfTwo(h);
+    }
+
+    if(h > job->maxH) {
+        return;
+    }
+
+    stbrp_rect* scratch = malloc(sizeof(stbrp_rect) * (job->numRects > 0 ? job->numRects : 1));
+
+    if(!scratch) {
+        return;
+    }
+
+    // Packers rarely need much more than the area bound, so the search gallops up from it
+    int fail = h - 1;
+    int fit = 0;
+    int step = h / 32 > 1 ? h / 32 : 1;
+
+    for(;;) {
+        if(PacksInto(job, scratch, w, h)) {
+            fit = h;
+            break;
+        }
+
+        fail = h;
+
+        int next = job->pot ? h * 2 : h + step;
+        step *= 2;
+
+        if(h == job->maxH || (job->pot && next > job->maxH)) {
+            break;
+        }
+
+        h = next < job->maxH ? next : job->maxH;
+    }
+
+    // and then bisects between the last height that failed and the first that fit
+    while(!job->pot && fit && fit - fail > 1) {
+        int mid = fail + (fit - fail) / 2;
+
+        if(PacksInto(job, scratch, w, mid)) {
+            fit = mid;
+        } else {
+            fail = mid;
+        }
+    }
+
+    free(scratch);
+
+    job->heights[index] = fit;
+}
+
+// Runs the jobs for numWidths widths and returns the index of the smallest fitting size, or -1
+static int SearchPackWidths(PackSizeJob* job, int numWidths)
+{
+    ParallelFor(numWidths, FindPackHeight, job);
+
+    int best = -1;
+
+    for(int i = 0; i < numWidths; ++i) {
+        if(job->heights[i] == 0) continue;
+
+        long long area = (long long)job->widths[i] * job->heights[i];
+        long long bestArea = best < 0 ? 0 : (long long)job->widths[best] * job->heights[best];
+
+        int side = job->widths[i] > job->heights[i] ? job->widths[i] : job->heights[i];
+        int bestSide = best < 0 ? 0 : (job->widths[best] > job->heights[best] ? job->widths[best] : job->heights[best]);
+
+        // Of two sizes with the same area the squarer one is kept
+        if(best < 0 || area < bestArea || (area == bestArea && side < bestSide)) {
+            best = i;
+        }
+    }
+
+    return best;
+}
+
+// Spreads numWidths widths evenly over [lo, hi], returns how many there are
+static int SpreadPackWidths(PackSizeJob* job, int lo, int hi)
+{
+    int numWidths = hi - lo + 1 < PACK_AUTO_WIDTHS ? hi - lo + 1 : PACK_AUTO_WIDTHS;
+
+    for(int i = 0; i < numWidths; ++i) {
+        job->widths[i] = numWidths > 1 ? lo + (int)((long long)(hi - lo) * i / (numWidths - 1)) : lo;
+    }
+
+    return numWidths;
+}
+
+// Finds the smallest --pack auto size (by area) the rectangles fit in, no bigger than maxW x maxH.
+// Returns false if they don't fit in that.
+static bool FindPackSize(const stbrp_rect* rects, int numRects, int maxW, int maxH, Packer packer, int flags, bool pot,
+                         int* packW, int* packH)
+{
+    PackSizeJob job = { rects, numRects, packer, flags, pot, 0, 1, maxH };
+
+    int minW = 1;
+
+    for(int i = 0; i < numRects; ++i) {
+        int w = rects[i].w;
+        int h = rects[i].h;
+
+        // Rectangles that may turn sideways only need their short side to fit either way
+        if((flags & PACK_ROTATE) && w > h) {
+            w = h;
+        } else if(flags & PACK_ROTATE) {
+            h = w;
+        }
+
+        if(w > minW) minW = w;
+        if(h > job.minH) job.minH = h;
+
+        job.area += (long long)rects[i].w * rects[i].h;
+    }
+
+    if(pot) {
+        minW = NextPowerOfTwo(minW);
+    }
+
+    if(minW > maxW || job.minH > maxH) {
+        return false;
+    }
+
+    int bestW = 0;
+    int bestH = 0;
+
+    if(pot) {
+        // Every power of two width, each one with the smallest power of two height that fits
+        int numWidths = 0;
+
+        for(int w = minW; w <= maxW && numWidths < 32; w *= 2) {
+            job.widths[numWidths++] = w;
+        }
+
+        int best = SearchPackWidths(&job, numWidths);
+
+        if(best >= 0) {
+            bestW = job.widths[best];
+            bestH = job.heights[best];
+        }
+    } else {
+        // The best widths are usually close to square, so those are searched first. The second round
+        // refines the width between the neighbours of the best one, or tries the wider ones if none fit.
+        int side = (int)ceil(sqrt((double)job.area));
+
+        long long narrowest = (job.area + maxH - 1) / maxH;
+
+        int lo = side / 2 > minW ? side / 2 : minW;
+        lo = narrowest > lo ? (int)(narrowest < maxW ? narrowest : maxW) : lo;
+        lo = lo < maxW ? lo : maxW;
+
+        int hi = side * 2 < maxW ? side * 2 : maxW;
+        hi = hi > lo ? hi : lo;
+
+        for(int round = 0; round < 2; ++round) {
+            int numWidths = SpreadPackWidths(&job, lo, hi);
+            int best = SearchPackWidths(&job, numWidths);
+
+            if(best < 0) {
+                if(hi == maxW) break;
+
+                lo = hi + 1;
+                hi = maxW;
+                continue;
+            }
+
+            long long area = (long long)job.widths[best] * job.heights[best];
+
+            if(bestW == 0 || area < (long long)bestW * bestH) {
+                bestW = job.widths[best];
+                bestH = job.heights[best];
+            }
+
+            if(round == 0) {
+                lo = best > 0 ? job.widths[best - 1] + 1 : job.widths[best];
+                hi = best < numWidths - 1 ? job.widths[best + 1] - 1 : job.widths[best];
+            }
+        }
+    }
+
+    if(bestW == 0) {
+        return false;
+    }
+
+    *packW = bestW;
+    *packH = bestH;
+
+    return true;
+}
+
+// One image of an atlas. With --pages, frames that don't fit go on further pages named like atlas_1.png.
+typedef struct
+{
+    char outputImage[512];
+
+    int dw, dh;
+    unsigned char* dest;
+
+    bool written;
+} AtlasPage;
+
+// One output atlas: the frames at a single scale along with the options scaled to match
+typedef struct
+{
+    Args args;
+    char outputImage[512];
+    float scale;
+
+    const Rect* frames;
+    stbrp_rect* rects;
+
+    // Page of every frame and whether it's stored transposed (see --rotate)
+    int* framePages;
+    bool* rotated;
+
+    // The --seed metadata for this scale
+    char seed[512];
+
+    AtlasPage* pages;
+    int numPages;
+
+    // The 1x --pack size a lower tier falls back to if its frames don't fit the scaled size, 0 for none
+    int fallbackPackW, fallbackPackH;
+
+    bool ok;
+} Atlas;
+
+static AtlasPage* AddAtlasPage(Atlas* atlas, int dw, int dh)
+{
+    AtlasPage* pages = realloc(atlas->pages, sizeof(AtlasPage) * (atlas->numPages + 1));
+
+    if(!pages) {
+        return NULL;
+    }
+
+    atlas->pages = pages;
+
+    AtlasPage* page = &pages[atlas->numPages];
+    memset(page, 0, sizeof(AtlasPage));
+
+    page->dw = dw;
+    page->dh = dh;
+
+    if(!atlas->args.pages) {
+        strcpy(page->outputImage, atlas->args.outputImage);
+    } else {
+        char suffix[32];
+        sprintf(suffix, "_%d", atlas->numPages);
+
+        if(!AddSuffix(page->outputImage, sizeof(page->outputImage), atlas->args.outputImage, suffix)) {
+            return NULL;
+        }
+    }
+
+    atlas->numPages += 1;
+
+    return page;
+}
+
+// --row-grid: the unique frames go left to right in reading order, wrapping into a new row at width dw,
+// and every row is as tall as its tallest frame. Returns the height of all rows.
+static int LayoutGridRows(Atlas* atlas, int dw)
+{
+    const Rect* frames = atlas->frames;
+    stbrp_rect* rects = atlas->rects;
+    int align = atlas->args.packAlign;
+
+    int x = 0;
+    int y = 0;
+    int rowH = 0;
+
+    for(int i = 0; i < NumFrames; ++i) {
+        if(frames[i].alias != i) continue;
+
+        // Rounding the sizes up keeps every position aligned, like for packing
+        int w = (frames[i].w + align - 1) / align * align;
+        int h = (frames[i].h + align - 1) / align * align;
+
+        if(x > 0 && x + w > dw) {
+            x = 0;
+            y += rowH;
+            rowH = 0;
+        }
+
+        rects[i].x = x;
+        rects[i].y = y;
+        rects[i].w = frames[i].w;
+        rects[i].h = frames[i].h;
+
+        x += w;
+
+        if(h > rowH) rowH = h;
+    }
+
+    return y + rowH;
+}
+
+// Picks the size of the grid atlas for numCells fw x fh cells: just enough rows for a fixed width,
+// or with a width of 0 the smallest power of two size (of any aspect) the cells fit in. Of equally
+// big sizes the squarer one wins, then the wider one.
+static void PlanGrid(int numCells, int fw, int fh, int fixedW, int* dw, int* dh)
+{
+    if(fixedW > 0) {
+        int columns = fixedW / fw;
+
+        *dw = fixedW;
+        *dh = (numCells + columns - 1) / columns * fh;
+        return;
+    }
+
+    *dw = 0;
+    *dh = 0;
+
+    // Widths past the one fitting every cell in a single row only add empty columns
+    int maxW = NextPowerOfTwo(numCells * fw);
+
+    for(int w = NextPowerOfTwo(fw); w <= maxW; w *= 2) {
+        int columns = w / fw;
+        int h = NextPowerOfTwo((numCells + columns - 1) / columns * fh);
+
+        long long area = (long long)w * h;
+        long long bestArea = (long long)*dw * *dh;
+
+        int side = w > h ? w : h;
+        int bestSide = *dw > *dh ? *dw : *dh;
+
+        if(*dw == 0 || area < bestArea || (area == bestArea && side <= bestSide)) {
+            *dw = w;
+            *dh = h;
+        }
+    }
+}
+
+// Puts every rectangle to pack (ids are frame indices) where the --seed metadata had its frame, if
+// the frame still has that size, and packs the others around them. The rectangles and the orientation
+// of the frames only change if all of them fit.
+static bool SeedPack(Atlas* atlas, stbrp_rect* packed, int numPacked, int dw, int dh)
+{
+    const Args* args = &atlas->args;
+    const Rect* frames = atlas->frames;
+    int align = args->packAlign;
+
+    FILE* file = fopen(atlas->seed, "r");
+
+    // Like on the first run of a build
+    if(!file) {
+        printf("There's no seed metadata '%s', packing all frames.\n", atlas->seed);
+        return false;
+    }
+
+    int numSeeds = 0;
+
+    if(fscanf(file, "%d", &numSeeds) != 1 || numSeeds < 0) {
+        fprintf(stderr, "Invalid seed metadata '%s', packing all frames.\n", atlas->seed);
+        fclose(file);
+        return false;
+    }
+
+    stbrp_rect* rects = malloc(sizeof(stbrp_rect) * (numPacked > 0 ? numPacked : 1));
+    bool* rotated = malloc(sizeof(bool) * NumFrames);
+    int* seeds = malloc(sizeof(int) * 4 * (numSeeds > 0 ? numSeeds : 1));
+
+    if(!rects || !rotated || !seeds) {
+        fprintf(stderr, "Failed to allocate the seed rectangles, packing all frames.\n");
+        fclose(file);
+        free(rects);
+        free(rotated);
+        free(seeds);
+        return false;
+    }
+
+    // Only x y w h are needed, the other columns depend on the options of that run
+    for(int i = 0; i < numSeeds; ++i) {
+        int* seed = &seeds[i * 4];
+
+        if(fscanf(file, "%d %d %d %d%*[^\n]", &seed[0], &seed[1], &seed[2], &seed[3]) != 4) {
+            numSeeds = i;
+            break;
+        }
+    }
+
+    fclose(file);
+
+    memcpy(rotated, atlas->rotated, sizeof(bool) * NumFrames);
+
+    for(int i = 0; i < numPacked; ++i) {
+        int id = packed[i].id;
+        int fw = frames[id].w;
+        int fh = frames[id].h;
+
+        rects[i] = packed[i];
+        rects[i].was_packed = 0;
+
+        if(id >= numSeeds) continue;
+
+        const int* seed = &seeds[id * 4];
+
+        if(seed[0] < 0 || seed[1] < 0 || seed[0] % align != 0 || seed[1] % align != 0) continue;
+
+        // A frame keeps its old orientation too, which may only be sideways with --rotate
+        bool upright = seed[2] == fw && seed[3] == fh;
+        bool sideways = args->rotate && fw != fh && seed[2] == fh && seed[3] == fw;
+
+        if(!upright && !sideways) continue;
+
+        rotated[id] = sideways;
+        rects[i].x = seed[0];
+        rects[i].y = seed[1];
+        rects[i].w = (seed[2] + align - 1) / align * align;
+        rects[i].h = (seed[3] + align - 1) / align * align;
+        rects[i].was_packed = 1;
+    }
+
+    qsort(rects, numPacked, sizeof(stbrp_rect), ComparePackHeight);
+
+    bool allPacked = MaxRectsPack(rects, numPacked, dw, dh, MAXRECTS_BEST_SHORT_SIDE, PACK_KEEP | (args->rotate ? PACK_ROTATE : 0));
+
+    if(allPacked) {
+        int numKept = 0;
+
+        for(int i = 0; i < numPacked; ++i) {
+            int id = rects[i].id;
+
+            numKept += id < numSeeds && rects[i].x == seeds[id * 4] && rects[i].y == seeds[id * 4 + 1] &&
+                       rects[i].was_packed != PACKED_ROTATED && rotated[id] == (seeds[id * 4 + 2] != frames[id].w);
+        }
+
+        printf("Kept %d of %d frames of '%s' in place.\n", numKept, numPacked, atlas->outputImage);
+
+        memcpy(packed, rects, sizeof(stbrp_rect) * numPacked);
+        memcpy(atlas->rotated, rotated, sizeof(bool) * NumFrames);
+    } else {
+        printf("The frames of '%s' don't fit around the seeded ones, packing all of them.\n", atlas->outputImage);
+    }
+
+    free(rects);
+    free(rotated);
+    free(seeds);
+
+    return allPacked;
+}
+
+static bool LayoutAtlas(Atlas* atlas)
+{
+    const Args* args = &atlas->args;
+    const Rect* frames = atlas->frames;
+    stbrp_rect* rects = atlas->rects;
+
+    int dw;
+    int dh;
+
+    int numUnique = 0;
+
+    for(int i = 0; i < NumFrames; ++i) {
+        numUnique += frames[i].alias == i;
+    }
+
+    if(args->rowGrid) {
+        dw = args->dw;
+
+        // Every power of two width is tried like for the cell grid, from the one the widest frame fits
+        if(args->pot) {
+            int maxW = 0;
+            long long sumW = 0;
+
+            for(int i = 0; i < NumFrames; ++i) {
+                if(frames[i].alias != i) continue;
+
+                int w = (frames[i].w + args->packAlign - 1) / args->packAlign * args->packAlign;
+
+                if(w > maxW) maxW = w;
+                sumW += w;
+            }
+
+            int bestW = 0;
+            int bestH = 0;
+
+            // Of equally big sizes the squarer one wins, then the wider one
+            for(int w = NextPowerOfTwo(maxW > 0 ? maxW : 1); bestW == 0 || w < 2 * sumW; w *= 2) {
+                int h = NextPowerOfTwo(LayoutGridRows(atlas, w));
+
+                long long area = (long long)w * h;
+                long long bestArea = (long long)bestW * bestH;
+
+                int side = w > h ? w : h;
+                int bestSide = bestW > bestH ? bestW : bestH;
+
+                if(bestW == 0 || area < bestArea || (area == bestArea && side <= bestSide)) {
+                    bestW = w;
+                    bestH = h;
+                }
+            }
+
+            dw = bestW;
+        }
+
+        dh = LayoutGridRows(atlas, dw);
+
+        if(args->pot) {
+            dh = NextPowerOfTwo(dh);
+        }
+
+        if(!AddAtlasPage(atlas, dw, dh)) {
+            return false;
+        }
+    } else if(args->packW == 0 && args->packH == 0) {
+        PlanGrid(numUnique, args->fw, args->fh, args->pot ? 0 : args->dw, &dw, &dh);
+
+        int columns = dw / args->fw;
+        int cell = 0;
+
+        for(int i = 0; i < NumFrames; ++i) {
+            if(frames[i].alias != i) continue;
+
+            rects[i].x = (cell % columns) * args->fw;
+            rects[i].y = (cell / columns) * args->fh;
+            rects[i].w = args->fw;
+            rects[i].h = args->fh;
+
+            cell += 1;
+        }
+
+        if(!AddAtlasPage(atlas, dw, dh)) {
+            return false;
+        }
+    } else {
+        dw = args->packW;
+        dh = args->packH;
+
+        int align = args->packAlign;
+
+        // Only unique frames are packed, the ids lead back to their frames
+        stbrp_rect* packed = malloc(sizeof(stbrp_rect) * NumFrames);
+        int numPacked = 0;
+
+        // Rounding the sizes up keeps every position the packers produce aligned too
+        for(int i = 0; packed && i < NumFrames; ++i) {
+            if(frames[i].alias != i) continue;
+
+            packed[numPacked].id = i;
+            packed[numPacked].w = (frames[i].w + align - 1) / align * align;
+            packed[numPacked].h = (frames[i].h + align - 1) / align * align;
+
+            // With --rotate every frame starts out lying down, so sorting by height lines up frames
+            // of similar thickness
+            atlas->rotated[i] = args->rotate && packed[numPacked].h > packed[numPacked].w;
+
+            if(atlas->rotated[i]) {
+                int w = packed[numPacked].w;
+
+                packed[numPacked].w = packed[numPacked].h;
+                packed[numPacked].h = w;
+            }
+
+            numPacked += 1;
+        }
+
+        int flags = args->rotate ? PACK_ROTATE : 0;
+
+        if(packed && args->packAuto) {
+            if(FindPackSize(packed, numPacked, args->packW, args->packH, args->packer, flags, args->pot, &dw, &dh)) {
+                printf("Smallest size '%s' fits in: %dx%d\n", args->outputImage, dw, dh);
+            } else if(!args->pages) {
+                fprintf(stderr, "The frames don't fit into %dx%d, try again with a bigger maximum size.\n", args->packW, args->packH);
+                free(packed);
+                return false;
+            }
+        }
+
+        // Every scaled frame is rounded up, which can add up to more than the scaled size of the atlas. The
+        // size then grows an eighth at a time, up to the 1x one.
+        if(packed && atlas->fallbackPackW > 0 && !args->pages) {
+            stbrp_rect* scratch = malloc(sizeof(stbrp_rect) * (numPacked > 0 ? numPacked : 1));
+            int scaledW = dw;
+            int scaledH = dh;
+
+            while(scratch) {
+                memcpy(scratch, packed, sizeof(stbrp_rect) * numPacked);
+
+                if(PackRects(scratch, numPacked, dw, dh, args->packer, NULL, flags)) break;
+                if(dw >= atlas->fallbackPackW && dh >= atlas->fallbackPackH) break;
+
+                dw = dw + dw / 8 + 1 < atlas->fallbackPackW ? dw + dw / 8 + 1 : atlas->fallbackPackW;
+                dh = dh + dh / 8 + 1 < atlas->fallbackPackH ? dh + dh / 8 + 1 : atlas->fallbackPackH;
+            }
+
+            if(dw != scaledW || dh != scaledH) {
+                printf("The frames of '%s' don't fit into %dx%d, using %dx%d instead.\n", atlas->outputImage, scaledW, scaledH, dw, dh);
+            }
+
+            free(scratch);
+        }
+
+        // With --seed, frames stay where they were if they can. Failing that, everything is packed from scratch.
+        bool seeded = packed && atlas->seed[0] && SeedPack(atlas, packed, numPacked, dw, dh);
+
+        // Every page takes what fits of the frames the earlier ones left over
+        int numLeft = packed ? numPacked : 0;
+
+        while(packed && numLeft > 0) {
+            AtlasPage* page = AddAtlasPage(atlas, dw, dh);
+
+            if(!page) {
+                free(packed);
+                return false;
+            }
+
+            bool allPacked = seeded || PackRects(packed, numLeft, dw, dh, args->packer, page->outputImage, flags | (args->pages ? PACK_PARTIAL : 0));
+
+            if(!allPacked && !args->pages) break;
+
+            int kept = 0;
+
+            for(int i = 0; i < numLeft; ++i) {
+                if(!packed[i].was_packed) {
+                    packed[kept++] = packed[i];
                     continue;
                 }
 
-    			int newDistFromEdge = 0;
-    			if (isBg) {
-    				newDistFromEdge = pt.distFromEdge + 1;
-    			}
+                stbrp_rect* r = &rects[packed[i].id];
+
+                r->x = packed[i].x;
+                r->y = packed[i].y;
+                r->w = frames[packed[i].id].w;
+                r->h = frames[packed[i].id].h;
+
+                atlas->framePages[packed[i].id] = atlas->numPages - 1;
+                atlas->rotated[packed[i].id] ^= packed[i].was_packed == PACKED_ROTATED;
+
+                if(atlas->rotated[packed[i].id]) {
+                    r->w = frames[packed[i].id].h;
+                    r->h = frames[packed[i].id].w;
+                }
+            }
+
+            if(kept == numLeft) {
+                fprintf(stderr, "Frame %d doesn't fit on a %dx%d page.\n", packed[0].id, dw, dh);
+                free(packed);
+                return false;
+            }
+
+            numLeft = kept;
+        }
+
+        if(!packed || numLeft > 0) {
+            fprintf(stderr, "Failed to pack (some) rectangles into '%s'. Try again with a different size, with --pages or don't pack at all.\n", args->outputImage);
+            free(packed);
+            return false;
+        }
+
+        free(packed);
+    }
+
+    // Duplicates share the rectangle of the frame they repeat
+    for(int i = 0; i < NumFrames; ++i) {
+        rects[i] = rects[frames[i].alias];
+        atlas->framePages[i] = atlas->framePages[frames[i].alias];
+        atlas->rotated[i] = atlas->rotated[frames[i].alias];
+    }
+
+    return true;
+}
+
+// How frame i is read from its rectangle. A frame stored transposed is read through one more swap of
+// x and y, which flips that bit.
+static int FrameTransform(const Atlas* atlas, int i)
+{
+    return atlas->frames[i].transform ^ (atlas->rotated[i] ? TRANSFORM_TRANSPOSE : 0);
+}
+
+// The raw frame table of every frame, or NULL if it can't be allocated
+static RawFrame* MakeRawFrames(const Atlas* atlas)
+{
+    RawFrame* frames = malloc(sizeof(RawFrame) * NumFrames);
+
+    if(!frames) {
+        fprintf(stderr, "Failed to allocate the raw frame table.\n");
+        return NULL;
+    }
+
+    for(int i = 0; i < NumFrames; ++i) {
+        frames[i].x = atlas->rects[i].x;
+        frames[i].y = atlas->rects[i].y;
+        frames[i].w = atlas->rects[i].w;
+        frames[i].h = atlas->rects[i].h;
+        frames[i].transform = FrameTransform(atlas, i);
+        frames[i].page = atlas->framePages[i];
+    }
+
+    return frames;
+}
+
+static bool WriteMetadata(const Atlas* atlas)
+{
+    // Output rectangle metadata in top-left to bottom-right order
+	char path[512];
+
+	if (!ReplaceExtension(path, sizeof(path), atlas->args.outputImage, "txt")) {
+		return false;
+	}
+
+	FILE* file = fopen(path, "w");
+
+	if (!file) {
+		fprintf(stderr, "Failed to open metadata file '%s' for writing.\n", path);
+		return false;
+	}
+
+	fprintf(file, "%d\n", NumFrames);
+
+	for (int i = 0; i < NumFrames; ++i) {
+        fprintf(file, "%d %d %d %d", atlas->rects[i].x, atlas->rects[i].y, atlas->rects[i].w, atlas->rects[i].h);
+
+        if (atlas->args.dedup) {
+            fprintf(file, " %d", atlas->frames[i].alias);
+        }
+
+        if (atlas->args.dedupTransforms || atlas->args.rotate) {
+            fprintf(file, " %d", FrameTransform(atlas, i));
+        }
+
+        if (atlas->args.pages) {
+            fprintf(file, " %d", atlas->framePages[i]);
+        }
+
+        fprintf(file, "\n");
+	}
+
+	fclose(file);
+	printf("Successfully wrote metadata to '%s'.\n", path);
+
+    return true;
+}
+
+// Writes frame pixel (x, y) to (dx + y, dy + x). Going through the frame in small tiles keeps both the
+// source rows and the destination rows a tile touches in cache.
+static void BlitTransposed(unsigned char* dest, int dw, int dx, int dy, const Rect* r)
+{
+    for(int ty = 0; ty < r->h; ty += TRANSPOSE_TILE) {
+        for(int tx = 0; tx < r->w; tx += TRANSPOSE_TILE) {
+            int endX = tx + TRANSPOSE_TILE < r->w ? tx + TRANSPOSE_TILE : r->w;
+            int endY = ty + TRANSPOSE_TILE < r->h ? ty + TRANSPOSE_TILE : r->h;
+
+            // Destination rows on the outside, so every one of them is written front to back
+            for(int x = tx; x < endX; ++x) {
+                Pixel* dst = (Pixel*)&dest[((size_t)(dy + x) * dw + dx) * 4];
+
+                for(int y = ty; y < endY; ++y) {
+                    Pixel sp = *(const Pixel*)&r->src[((size_t)(y + r->y) * r->sw + x + r->x) * 4];
+
+                    if(PixelEqual(&sp, &r->bg)) continue;
+
+                    dst[y] = sp;
+                }
+            }
+        }
+    }
+}
+
+// Writes the frame's pixels that aren't background to (dx, dy). Where SSE2 is available, rows go
+// through memcpy up to their first background pixel and the rest is blended 8 pixels at a time.
+static void BlitMasked(unsigned char* dest, int dw, int dx, int dy, const Rect* r)
+{
+#ifdef USE_SSE2
+    unsigned int bg;
+    memcpy(&bg, &r->bg, 4);
+
+    const __m128i bgv = _mm_set1_epi32((int)bg);
+#endif
+
+    for(int y = 0; y < r->h; ++y) {
+        const unsigned char* src = &r->src[((size_t)(y + r->y) * r->sw + r->x) * 4];
+        unsigned char* dst = &dest[((size_t)(y + dy) * dw + dx) * 4];
+
+        int x = 0;
+
+#ifdef USE_SSE2
+        // Everything up to the first background pixel is copied as is, which is the whole row often
+        int mask = 0;
+
+        for(; x + 8 <= r->w; x += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + x * 4));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + x * 4 + 16));
+
+            mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi32(a, bgv), _mm_cmpeq_epi32(b, bgv)));
+
+            if(mask) break;
+        }
+
+        if(!mask) {
+            while(x < r->w && !PixelEqual((const Pixel*)(src + x * 4), &r->bg)) x += 1;
+        }
+
+        memcpy(dst, src, (size_t)x * 4);
+
+        if(x == r->w) continue;
+
+        // Background lanes keep what's in the atlas already
+        for(; x + 8 <= r->w; x += 8) {
+            __m128i a = _mm_loadu_si128((const __m128i*)(src + x * 4));
+            __m128i b = _mm_loadu_si128((const __m128i*)(src + x * 4 + 16));
+
+            __m128i maskA = _mm_cmpeq_epi32(a, bgv);
+            __m128i maskB = _mm_cmpeq_epi32(b, bgv);
+
+            if(_mm_movemask_epi8(_mm_and_si128(maskA, maskB)) == 0xffff) continue;
+
+            __m128i* outA = (__m128i*)(dst + x * 4);
+            __m128i* outB = (__m128i*)(dst + x * 4 + 16);
+
+            _mm_storeu_si128(outA, _mm_or_si128(_mm_andnot_si128(maskA, a), _mm_and_si128(maskA, _mm_loadu_si128(outA))));
+            _mm_storeu_si128(outB, _mm_or_si128(_mm_andnot_si128(maskB, b), _mm_and_si128(maskB, _mm_loadu_si128(outB))));
+        }
+#endif
+
+        for(; x < r->w; ++x) {
+            const Pixel* sp = (const Pixel*)(src + x * 4);
+
+            if(PixelEqual(sp, &r->bg)) continue;
+
+            *(Pixel*)(dst + x * 4) = *sp;
+        }
+    }
+}
+
+static bool ComposeAtlas(Atlas* atlas)
+{
+    const Args* args = &atlas->args;
+
+    for(int i = 0; i < atlas->numPages; ++i) {
+        AtlasPage* page = &atlas->pages[i];
+
+        page->dest = calloc(4, (size_t)page->dw * page->dh);
+
+        if(!page->dest) {
+            return false;
+        }
+    }
+
+    for(int i = 0; i < NumFrames; ++i) {
+        Rect r = atlas->frames[i];
+
+        // Duplicates share the pixels of the frame they repeat
+        if(r.alias != i) continue;
+
+        const AtlasPage* page = &atlas->pages[atlas->framePages[i]];
+
+        unsigned char* dest = page->dest;
+        int dw = page->dw;
+        int dh = page->dh;
+
+        int dx = atlas->rects[i].x;
+        int dy = atlas->rects[i].y;
+
+        if(args->packW == 0 && args->packH == 0 && !args->rowGrid) {
+            // Center the frame in its cell
+            dx += args->fw / 2 - r.w / 2;
+            dy += args->fh / 2 - r.h / 2;
+        }
+
+        if(atlas->rotated[i]) {
+            BlitTransposed(dest, dw, dx, dy, &r);
+        } else {
+            BlitMasked(dest, dw, dx, dy, &r);
+        }
+
+		if (args->label) {
+			char num[32];
+			sprintf(num, "%d", i);
+
+			int len = strlen(num);
+
+			for (int i = 0; i < len; ++i) {
+				int digit = num[i] - '0';
+
+				for (int y = 0; y < 5; ++y) {
+					for (int x = 0; x < 3; ++x) {
+						// Frames of the smaller tiers can be tinier than the label
+						if (dx + x + i * 4 >= dw || y + dy >= dh) continue;
+
+						Pixel sp = NumFont[digit][x + y * 3];
+
+						*(Pixel*)(&dest[(dx + x + i * 4) * 4 + (y + dy) * (dw * 4)]) = sp;
+					}
+				}
+			}
+		}
+    }
+
+    return true;
+}
 
-    			checked[pt.x + pt.y * w] = true;
-        
-                if(!isBg) {
-                    if(pt.x < minX) {
-                        minX = pt.x;
-                    }
+// Lays out, describes and composites one atlas. Atlases are independent so they're built in parallel.
+static void BuildAtlas(void* data, int index, int thread)
+{
+    Atlas* atlas = (Atlas*)data + index;
 
-                    if(pt.y < minY) {
-                        minY = pt.y;
-                    }
-                    
-                    if(pt.x > maxX) {
-                        maxX = pt.x;
-                    }
-                    
-                    if(pt.y > maxY) {
-                        maxY = pt.y;
-                    }
-                }
+    (void)thread;
 
-                assert(numPoints < MAX_POINTS);
+    atlas->ok = LayoutAtlas(atlas) &&
+                (!atlas->args.metadata || WriteMetadata(atlas)) &&
+                ComposeAtlas(atlas);
+}
 
-                points[numPoints++] = (Point){pt.x - 1, pt.y, newDistFromEdge};
-                points[numPoints++] = (Point){pt.x, pt.y - 1, newDistFromEdge};
-                points[numPoints++] = (Point){pt.x + 1, pt.y, newDistFromEdge};
-                points[numPoints++] = (Point){pt.x, pt.y + 1, newDistFromEdge};
-            }
+// Writes one level of the atlas in any of the formats that don't hold a mip chain
+static bool WriteImage(const Args* args, const char* filename, const MipLevel* image, int level,
+                       const RawFrame* rects, int numRects)
+{
+    if(args->format == OUTPUT_QOI) {
+        return QoiWrite(filename, image->data, image->w, image->h, image->w * 4);
+    } else if(args->format == OUTPUT_RAW) {
+        return RawWrite(filename, image->data, image->w, image->h, image->w * 4, args->pixelFormat, rects, numRects, level);
+    }
 
-            Rect r = { src, w, h, *bg, minX, minY, maxX - minX + 1, maxY - minY + 1 };
+    return PngWrite(filename, image->data, image->w, image->h, image->w * 4, &EncodePresets[args->encodePreset], !args->rgba);
+}
 
-    		if (r.w < args->minW && r.h < args->minH) {
-    			fprintf(stderr, "Found rect (%d,%d,%d,%d) but it's too small so I'm skipping it.\n", r.x, r.y, r.w, r.h);
-    		} else if(r.w > fw) {
-                fprintf(stderr, "Found rect (%d,%d,%d,%d) but it's too large to fit in a single frame so I'm skipping it.\n", r.x, r.y, r.w, r.h);
-            } else {
-                assert(NumFrames < MAX_FRAMES);
-                Frames[NumFrames++] = r;
-            }
+// Old and new pixels of a page compared by --dirty-rects, with a flag for every block
+typedef struct
+{
+    const unsigned char* old;
+    const unsigned char* cur;
+    size_t oldStride, curStride;
+    int w, h;
+    int bpp;
+
+    int blocksX;
+    unsigned char* dirty;
+} DirtyDiff;
+
+static bool BytesEqual(const unsigned char* a, const unsigned char* b, int n)
+{
+    int i = 0;
+
+#ifdef USE_SSE2
+    for(; i + 64 <= n; i += 64) {
+        __m128i e0 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+        __m128i e1 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 16)), _mm_loadu_si128((const __m128i*)(b + i + 16)));
+        __m128i e2 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 32)), _mm_loadu_si128((const __m128i*)(b + i + 32)));
+        __m128i e3 = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i + 48)), _mm_loadu_si128((const __m128i*)(b + i + 48)));
+
+        if(_mm_movemask_epi8(_mm_and_si128(_mm_and_si128(e0, e1), _mm_and_si128(e2, e3))) != 0xffff) {
+            return false;
         }
     }
 
-    free(checked);
+    for(; i + 16 <= n; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i*)(a + i)), _mm_loadu_si128((const __m128i*)(b + i)));
+
+        if(_mm_movemask_epi8(eq) != 0xffff) {
+            return false;
+        }
+    }
+#endif
+
+    return memcmp(a + i, b + i, n - i) == 0;
 }
 
-static void TraverseImages(tfFILE* file, void* data)
+// Flags the blocks of one row of blocks that have any pixel changed. Rows of a block that's already
+// dirty aren't looked at again.
+static void DiffBlockRow(void* data, int by, int thread)
 {
-	ExtractFrames(file->path, data);
+    DirtyDiff* diff = data;
+    unsigned char* dirty = diff->dirty + (size_t)by * diff->blocksX;
+
+    (void)thread;
+
+    int endY = (by + 1) * DIRTY_BLOCK < diff->h ? (by + 1) * DIRTY_BLOCK : diff->h;
+
+    for(int y = by * DIRTY_BLOCK; y < endY; ++y) {
+        const unsigned char* old = diff->old + (size_t)y * diff->oldStride;
+        const unsigned char* cur = diff->cur + (size_t)y * diff->curStride;
+
+        for(int bx = 0; bx < diff->blocksX; ++bx) {
+            if(dirty[bx]) continue;
+
+            int x = bx * DIRTY_BLOCK;
+            int w = x + DIRTY_BLOCK < diff->w ? DIRTY_BLOCK : diff->w - x;
+
+            dirty[bx] = !BytesEqual(old + (size_t)x * diff->bpp, cur + (size_t)x * diff->bpp, w * diff->bpp);
+        }
+    }
 }
 
-int main(int argc, char** argv)
+// Loads the pixels of an atlas written earlier in the format it would be written in now: RGBA8 for
+// PNG and QOI, the raw pixel format for raw files. Returns NULL if there's none (of that format).
+static unsigned char* LoadOldAtlas(const Args* args, const char* path, int* w, int* h, size_t* stride, unsigned char** data)
 {
-    Args args;
+    *data = NULL;
 
-    if(!ParseArgs(&args, argc, argv)) {
-        return 1;
+    if(args->format != OUTPUT_RAW) {
+        const char* reason;
+        *data = LoadImage(path, w, h, &reason);
+        *stride = (size_t)*w * 4;
+
+        return *data;
     }
 
-    if(args.isDir) {
-		tfTraverse(args.inputImage, TraverseImages, &args);
-    } else {
-        ExtractFrames(args.inputImage, &args);
+    size_t size = 0;
+    *data = ReadEntireFile(path, &size);
+
+    if(!*data || size < RAW_HEADER_SIZE || memcmp(*data, "SPXA", 4) != 0 || ReadU32LE(*data + 16) != (unsigned int)args->pixelFormat) {
+        free(*data);
+        *data = NULL;
+        return NULL;
     }
 
-    if(NumFrames == 0) {
-        fprintf(stderr, "I found no frames. Are you sure you supplied the correct input?\n");
-        return 1;
+    *w = (int)ReadU32LE(*data + 8);
+    *h = (int)ReadU32LE(*data + 12);
+    *stride = ReadU32LE(*data + 20);
+
+    unsigned long long offset = ReadU64LE(*data + 32);
+
+    if(*stride < (size_t)*w * RawBytesPerPixel(args->pixelFormat) || offset > size || (size - offset) / (*stride > 0 ? *stride : 1) < (size_t)*h) {
+        free(*data);
+        *data = NULL;
+        return NULL;
     }
- 
-    qsort(Frames, NumFrames, sizeof(Rect), CompareFrames);
 
-    int dw;
-    int dh;
+    return *data + offset;
+}
 
-    static stbrp_rect rects[MAX_FRAMES];
+// Compares the page with the image it's about to replace and writes the changed rectangles next to it.
+// Dirty blocks are merged into runs along each row of blocks, and runs covering the same columns in
+// consecutive rows into one rectangle.
+static bool WriteDirtyRects(const Atlas* atlas, const AtlasPage* page)
+{
+    const Args* args = &atlas->args;
+    int dw = page->dw;
+    int dh = page->dh;
 
-    if(args.packW == 0 && args.packH == 0) {
-        if(args.pot) {
-            int reqArea = NumFrames * args.fw * args.fh;
+    char path[512];
+    char dirtyPath[512];
 
-            dw = args.fw;
-            dh = args.fh;
-         
-            while(dw * dh < reqArea) {
-                dw *= 2;
-                dh *= 2;
-            }
-        } else {
-            dw = args.dw;
-            dh = ((NumFrames * args.fw) / dw + 1) * args.fh;
+    if(!AddSuffix(path, sizeof(path), page->outputImage, "_dirty") || !ReplaceExtension(dirtyPath, sizeof(dirtyPath), path, "txt")) {
+        return false;
+    }
+
+    int ow = 0, oh = 0;
+    size_t oldStride = 0;
+    unsigned char* oldData;
+    const unsigned char* old = LoadOldAtlas(args, page->outputImage, &ow, &oh, &oldStride, &oldData);
+
+    // The new pixels are compared as they're stored
+    unsigned char* converted = NULL;
+
+    if(old && ow == dw && oh == dh && args->format == OUTPUT_RAW && args->pixelFormat != RAW_PIXEL_RGBA8) {
+        converted = ConvertToPacked(page->dest, dw, dh, dw * 4, args->pixelFormat);
+
+        if(!converted) {
+            free(oldData);
+            return false;
         }
+    }
+
+    int blocksX = (dw + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+    int blocksY = (dh + DIRTY_BLOCK - 1) / DIRTY_BLOCK;
+
+    DirtyDiff diff = { old, converted ? converted : page->dest, oldStride, converted ? (size_t)dw * 2 : (size_t)dw * 4, dw, dh,
+                       converted ? 2 : 4, blocksX, calloc((size_t)blocksX * blocksY, 1) };
+
+    int* openRect = malloc(sizeof(int) * blocksX * 2);
+
+    if(!diff.dirty || !openRect) {
+        free(oldData);
+        free(converted);
+        free(diff.dirty);
+        free(openRect);
+        return false;
+    }
+
+    if(old && ow == dw && oh == dh) {
+        ParallelFor(blocksY, DiffBlockRow, &diff);
     } else {
-        dw = args.packW;
-        dh = args.packH;
+        memset(diff.dirty, 1, (size_t)blocksX * blocksY);
+    }
 
-        stbrp_context ctx;
+    free(oldData);
+    free(converted);
 
-        stbrp_node* nodes = malloc(sizeof(stbrp_node) * dw);
+    // openRect holds the rectangle each run of the previous row of blocks started at column bx went
+    // into, the other half is filled in for the current row
+    PackRectList rects = { 0 };
+    bool failed = false;
 
-        stbrp_init_target(&ctx, dw, dh, nodes, dw);
+    int* prevOpen = openRect;
+    int* curOpen = openRect + blocksX;
 
-        for(int i = 0; i < NumFrames; ++i) {
-            rects[i].w = Frames[i].w;
-            rects[i].h = Frames[i].h;
+    for(int bx = 0; bx < blocksX; ++bx) {
+        prevOpen[bx] = -1;
+    }
+
+    for(int by = 0; by < blocksY && !failed; ++by) {
+        const unsigned char* dirty = diff.dirty + (size_t)by * blocksX;
+
+        for(int bx = 0; bx < blocksX; ++bx) {
+            curOpen[bx] = -1;
         }
 
-        if(stbrp_pack_rects(&ctx, rects, NumFrames) != 1) {
-            fprintf(stderr, "Failed to pack (some) rectangles. Try again with a different size or don't pack at all.\n");
-            return 1;
+        for(int bx = 0; bx < blocksX; ) {
+            if(!dirty[bx]) {
+                bx += 1;
+                continue;
+            }
+
+            int start = bx;
+
+            while(bx < blocksX && dirty[bx]) bx += 1;
+
+            int prev = prevOpen[start];
+
+            if(prev >= 0 && rects.items[prev].w == bx - start) {
+                rects.items[prev].h += 1;
+                curOpen[start] = prev;
+            } else {
+                curOpen[start] = rects.count;
+                PackRectListPush(&rects, (PackRect){ start, by, bx - start, 1 }, &failed);
+            }
         }
 
-        free(nodes);
+        int* swap = prevOpen;
+        prevOpen = curOpen;
+        curOpen = swap;
     }
-    if(args.metadata) {
-        // Output rectangle metadata in top-left to bottom-right order
-		char path[512];
 
-		if (strlen(args.outputImage) >= 512) {
-			fprintf(stderr, "Failed; output image path is too long to generate metadata.\n");
-			return 1;
-		}
+    free(diff.dirty);
+    free(openRect);
+
+    FILE* file = failed ? NULL : fopen(dirtyPath, "w");
 
-		strcpy(path, args.outputImage);
+    if(!file) {
+        fprintf(stderr, "Failed to write dirty rectangles to '%s'.\n", dirtyPath);
+        free(rects.items);
+        return false;
+    }
 
-		char* ext = strrchr(path, '.');
+    long long dirtyArea = 0;
 
-		if (!ext) {
-			fprintf(stderr, "Failed; missing extension on output image path.\n");
-			return 1;
-		}
+    fprintf(file, "%d\n", rects.count);
 
-		ext[1] = 't';
-		ext[2] = 'x';
-		ext[3] = 't';
-		ext[4] = '\0';
+    for(int i = 0; i < rects.count; ++i) {
+        const PackRect* r = &rects.items[i];
 
-		FILE* file = fopen(path, "w");
+        int x = r->x * DIRTY_BLOCK;
+        int y = r->y * DIRTY_BLOCK;
+        int w = (r->x + r->w) * DIRTY_BLOCK < dw ? r->w * DIRTY_BLOCK : dw - x;
+        int h = (r->y + r->h) * DIRTY_BLOCK < dh ? r->h * DIRTY_BLOCK : dh - y;
 
-		if (!file) {
-			fprintf(stderr, "Failed to open metadata file '%s' for writing.\n", path);
-			return 1;
-		}
+        fprintf(file, "%d %d %d %d\n", x, y, w, h);
 
-		fprintf(file, "%d\n", NumFrames);
+        dirtyArea += (long long)w * h;
+    }
 
-		for (int i = 0; i < NumFrames; ++i) {
-            if(args.packW > 0 && args.packH > 0) {
-                fprintf(file, "%d %d %d %d\n", rects[i].x, rects[i].y, rects[i].w, rects[i].h);
-            } else {
-				int columns = dw / args.fw;
+    fclose(file);
+    free(rects.items);
+
+    printf("Successfully wrote %d dirty rectangles (%.1f%% of the atlas) to '%s'.\n", rects.count,
+           100.0 * dirtyArea / ((double)dw * dh), dirtyPath);
+
+    return true;
+}
+
+static bool EncodePage(const Atlas* atlas, const AtlasPage* page)
+{
+    const Args* args = &atlas->args;
+    const char* outputImage = page->outputImage;
+    unsigned char* dest = page->dest;
+    int dw = page->dw;
+    int dh = page->dh;
+
+    if(args->dirtyRects && !WriteDirtyRects(atlas, page)) {
+        return false;
+    }
+
+    // The table is printed at once so the ones of pages encoded in parallel don't interleave
+    if(args->benchmark) {
+        char table[1024];
+        int len = snprintf(table, sizeof(table), "Encoding '%s':\n%-10s %14s %12s\n", outputImage, "preset", "size (bytes)", "time (ms)");
 
-				int dx = (i % columns) * args.fw;
-				int dy = (i / columns) * args.fh;
+        for(int i = 0; i < NUM_ENCODE_PRESETS; ++i) {
+            double start = GetSeconds();
 
-                fprintf(file, "%d %d %d %d\n", dx, dy, args.fw, args.fh);
+            if(!PngWrite(outputImage, dest, dw, dh, dw * 4, &EncodePresets[i], !args->rgba)) {
+                fprintf(stderr, "Failed to write file.\n");
+                return false;
             }
-		}
 
-		fclose(file);
-		printf("Successfully wrote metadata to '%s'.\n", path);
+            double elapsed = GetSeconds() - start;
+
+            size_t size = 0;
+            free(ReadEntireFile(outputImage, &size));
+
+            if(len < (int)sizeof(table)) {
+                len += snprintf(table + len, sizeof(table) - len, "%-10s %14zu %12.2f\n", EncodePresets[i].name, size, elapsed * 1000.0);
+            }
+        }
+
+        fputs(table, stdout);
     }
-    
-    unsigned char* dest = calloc(4, dw * dh);
 
-    for(int i = 0; i < NumFrames; ++i) {
-        Rect r = Frames[i];
+    RawFrame* rawFrames = NULL;
+
+    if(args->format == OUTPUT_RAW) {
+        rawFrames = MakeRawFrames(atlas);
+
+        if(!rawFrames) {
+            return false;
+        }
+    }
+
+    MipLevel top = { dest, dw, dh };
+    MipLevel* levels = &top;
+    int numLevels = 1;
+
+    if(args->mips) {
+        levels = GenerateMips(dest, dw, dh, &numLevels);
+
+        if(!levels) {
+            fprintf(stderr, "Failed to allocate the mip chain.\n");
+            free(rawFrames);
+            return false;
+        }
+    }
+
+    bool written;
+
+    if(args->format == OUTPUT_BC1 || args->format == OUTPUT_BC3) {
+        written = DdsWrite(outputImage, levels, numLevels, args->format);
+    } else {
+        written = WriteImage(args, outputImage, &levels[0], 0, rawFrames, NumFrames);
+
+        for(int i = 1; written && i < numLevels; ++i) {
+            char path[512];
+            char suffix[32];
+
+            sprintf(suffix, "_mip%d", i);
 
-        int dx, dy;
+            written = AddSuffix(path, sizeof(path), outputImage, suffix) &&
+                      WriteImage(args, path, &levels[i], i, rawFrames, NumFrames);
+        }
+    }
 
-		int fw = args.fw;
-		int fh = args.fh;
+    if(!written) {
+        fprintf(stderr, "Failed to write file '%s'.\n", outputImage);
+    } else {
+        printf("Successfully wrote '%s'.\n", outputImage);
+    }
 
-        if(args.packW == 0 && args.packH == 0) {
-			int columns = dw / fw;
+    if(written && args->etc2 != ETC2_NONE) {
+        char path[512];
 
-            dx = (i % columns) * fw + fw / 2 - r.w / 2;
-            dy = (i / columns) * fh + fh / 2 - r.h / 2;
+        if(!ReplaceExtension(path, sizeof(path), outputImage, "ktx")) {
+            written = false;
+        } else if(!KtxWrite(path, levels, numLevels, args->etc2 == ETC2_QUALITY)) {
+            fprintf(stderr, "Failed to write ETC2 file '%s'.\n", path);
+            written = false;
         } else {
-            dx = rects[i].x;
-            dy = rects[i].y;
+            printf("Successfully wrote ETC2 atlas to '%s'.\n", path);
+        }
+    }
+
+    if(args->mips) {
+        FreeMips(levels, numLevels);
+    }
+
+    free(rawFrames);
+
+    return written;
+}
+
+// Pages are independent, so they're encoded in parallel
+static void EncodeAtlasPage(void* data, int index, int thread)
+{
+    Atlas* atlas = data;
+    AtlasPage* page = &atlas->pages[index];
+
+    (void)thread;
+
+    page->written = EncodePage(atlas, page);
+}
+
+int main(int argc, char** argv)
+{
+    Args args;
+
+    if(!ParseArgs(&args, argc, argv)) {
+        return 1;
+    }
+
+    if(args.benchPack > 0) {
+        return BenchmarkPackers(args.benchPack) ? 0 : 1;
+    }
+
+    InitDeflateTables();
+
+    if(args.isDir) {
+		tfTraverse(args.inputImage, TraverseImages, &args);
+    } else {
+        ExtractFrames(args.inputImage, &args);
+    }
+
+    if(NumFrames == 0) {
+        fprintf(stderr, "I found no frames. Are you sure you supplied the correct input?\n");
+        return 1;
+    }
+ 
+    if(!OrderFrames()) {
+        fprintf(stderr, "Failed to allocate the frame order.\n");
+        return 1;
+    }
+
+    for(int i = 0; i < NumFrames; ++i) {
+        Frames[i].alias = i;
+        Frames[i].transform = 0;
+    }
+
+    if(args.dedup && !DedupFrames(args.dedupTransforms)) {
+        fprintf(stderr, "Failed to allocate the frame hash table.\n");
+        return 1;
+    }
+
+    // Every tier reuses the detected frames, shrunk to its scale
+    static Atlas atlases[MAX_SCALES];
+
+    for(int i = 0; i < args.numScales; ++i) {
+        Atlas* atlas = &atlases[i];
+        float scale = args.scales[i];
+
+        atlas->args = args;
+        atlas->scale = scale;
+        atlas->frames = Frames;
+        atlas->rects = calloc(NumFrames, sizeof(stbrp_rect));
+        atlas->framePages = calloc(NumFrames, sizeof(int));
+        atlas->rotated = calloc(NumFrames, sizeof(bool));
+
+        if(!atlas->rects || !atlas->framePages || !atlas->rotated) {
+            fprintf(stderr, "Failed to allocate the frame rectangles.\n");
+            return 1;
         }
 
-        for(int y = 0; y < r.h; ++y) {
-            for(int x = 0; x < r.w; ++x) {
-                Pixel sp = *(Pixel*)(&r.src[((x + r.x) * 4) + (y + r.y) * (r.sw * 4)]);
+        if(scale == 1.0f) {
+            strcpy(atlas->outputImage, args.outputImage);
+
+            if(args.seed && strlen(args.seed) >= sizeof(atlas->seed)) {
+                fprintf(stderr, "Failed; seed metadata path is too long.\n");
+                return 1;
+            }
+
+            if(args.seed) {
+                strcpy(atlas->seed, args.seed);
+            }
+        } else {
+            char suffix[32];
+            sprintf(suffix, "@%gx", scale);
+
+            if(!AddSuffix(atlas->outputImage, sizeof(atlas->outputImage), args.outputImage, suffix)) {
+                return 1;
+            }
+
+            if(args.seed && !AddSuffix(atlas->seed, sizeof(atlas->seed), args.seed, suffix)) {
+                return 1;
+            }
+
+            atlas->frames = ScaleFrames(Frames, NumFrames, scale);
+
+            if(!atlas->frames) {
+                fprintf(stderr, "Failed to scale the frames by %g.\n", scale);
+                return 1;
+            }
+
+            // Grid cells keep their layout, so the dest width stays a multiple of the cell width
+            atlas->args.dw = args.dw / args.fw * ScaleSize(args.fw, scale);
+            atlas->args.fw = ScaleSize(args.fw, scale);
+            atlas->args.fh = ScaleSize(args.fh, scale);
 
-                if(PixelEqual(&sp, &r.bg)) continue;
-                
-                *(Pixel*)(&dest[(dx + x) * 4 + (y + dy) * (dw * 4)]) = sp; 
+            // The --pack auto maximum is a hardware limit, so it stays the same
+            if(args.packW > 0 && !args.packAuto) {
+                atlas->args.packW = ScaleSize(args.packW, scale);
+                atlas->args.packH = ScaleSize(args.packH, scale);
+                atlas->fallbackPackW = args.packW;
+                atlas->fallbackPackH = args.packH;
             }
         }
 
-		if (args.label) {
-			char num[32];
-			sprintf(num, "%d", i);
+        atlas->args.outputImage = atlas->outputImage;
+    }
 
-			int len = strlen(num);
+    ParallelFor(args.numScales, BuildAtlas, atlases);
 
-			for (int i = 0; i < len; ++i) {
-				int digit = num[i] - '0';
+    bool ok = true;
 
-				for (int y = 0; y < 5; ++y) {
-					for (int x = 0; x < 3; ++x) {
-						Pixel sp = NumFont[digit][x + y * 3];
+    for(int i = 0; i < args.numScales; ++i) {
+        ok = ok && atlases[i].ok;
+    }
 
-						*(Pixel*)(&dest[(dx + x + i * 4) * 4 + (y + dy) * (dw * 4)]) = sp;
-					}
-				}
-			}
-		}
+    if(!ok) {
+        return 1;
     }
 
-    if(stbi_write_png(args.outputImage, dw, dh, 4, dest, dw * 4) == 0) {
-        fprintf(stderr, "Failed to write file.\n");
-    } else {
-        printf("Succeeded.\n");
+    // Encoding is the bulk of the work and spreads over all threads by itself, so tiers go one at a time
+    for(int i = 0; i < args.numScales; ++i) {
+        ParallelFor(atlases[i].numPages, EncodeAtlasPage, &atlases[i]);
+
+        for(int j = 0; j < atlases[i].numPages; ++j) {
+            ok = ok && atlases[i].pages[j].written;
+        }
     }
 
+    if(!ok) {
+        return 1;
+    }
+
+    printf("Succeeded.\n");
+
     return 0;
 }